@@ -1,97 +1,846 @@
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
-#include <boost/iterator/zip_iterator.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <boost/iterator/counting_iterator.hpp>
+#include <cassert>
+#include <cfloat>
 #include <chrono>
+#include <complex>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <execution>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <math.h>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <tbb/task_arena.h>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
 #include <vector>
+#if defined(__linux__)
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-float MOUSE_ADD = 100.0;
-float MOUSE_MULT = 3;
+// Cells whose magnitude exceeds this count as active in FieldStats.
+constexpr float ACTIVE_THRESHOLD = 1e-3f;
 
 inline double distance(const std::pair<double, double> &from,
                        const std::pair<double, double> &to) {
   return sqrt(pow(from.first - to.first, 2) + pow(from.second - to.second, 2));
 }
 
-class Image {
+// Maps a cell value to the colour it is displayed with.
+inline olc::Pixel colormap(float value) {
+  const float v = (sin(value) + 1.0f) / 2.0f;
+  return olc::PixelF(v, v, v);
+}
+
+// A region of an RGBA framebuffer showing the cells [originX, originX + width)
+// x [originY, originY + height) of the grid, one pixel per cell.
+struct FrameTarget {
+  olc::Pixel *pixels;
+  size_t stride;
+  size_t originX;
+  size_t originY;
+  size_t width;
+  size_t height;
+};
+
+// Reductions of a field, gathered while it is being computed.
+struct FieldStats {
+  double sum = 0.0;
+  float min = std::numeric_limits<float>::infinity();
+  float max = -std::numeric_limits<float>::infinity();
+  size_t active = 0;
+  // Change of sum over the step that produced the field.
+  double drift = 0.0;
+
+  void add(float value) {
+    sum += value;
+    min = std::min(min, value);
+    max = std::max(max, value);
+    active += std::fabs(value) > ACTIVE_THRESHOLD;
+  }
+
+  void merge(const FieldStats &other) {
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    active += other.active;
+  }
+};
+
+namespace trace {
+// A span of work on one thread, in nanoseconds since tracing started.
+struct Span {
+  const char *name;
+  int64_t begin;
+  int64_t end;
+};
+
+// The spans of one thread, in chunks that double in size as they fill, so
+// threads that record little hold little. Only that thread appends,
+// publishing each span with a release of count, so recording takes no
+// lock. Spans that find every buffer's chunks together at capacity are
+// counted and dropped.
+struct Buffer {
+  static constexpr size_t firstChunk = 256;
+  static constexpr size_t maxChunks = 16;
+  struct Chunk {
+    std::unique_ptr<Span[]> spans;
+    size_t size = 0;
+  };
+  Chunk chunks[maxChunks];
+  std::atomic<size_t> count{0};
+  std::atomic<size_t> dropped{0};
+  size_t thread = 0;
+  std::string label;
+  // The free part of the last chunk, only used by the owning thread.
+  Span *next = nullptr;
+  Span *end = nullptr;
+  size_t used = 0;
+};
+
+// Spans all buffers may hold together, about 48 MB, and those taken.
+constexpr size_t capacity = size_t(1) << 21;
+std::atomic<size_t> reserved{0};
+
+std::atomic<bool> enabled{false};
+std::chrono::steady_clock::time_point origin;
+// Every thread's buffer, kept after the thread exits. Locked only when a
+// thread records its first span and when the trace is written.
+std::mutex buffersLock;
+std::vector<std::unique_ptr<Buffer>> buffers;
+
+Buffer &local() {
+  thread_local Buffer *buffer = [] {
+    std::lock_guard<std::mutex> lock(buffersLock);
+    buffers.push_back(std::make_unique<Buffer>());
+    buffers.back()->thread = buffers.size();
+    return buffers.back().get();
+  }();
+  return *buffer;
+}
+
+int64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - origin)
+      .count();
+}
+
+// Adds a chunk to the calling thread's buffer, twice the size of its last
+// one or what is left of the capacity. False when nothing is left.
+bool grow(Buffer &buffer) {
+  if (buffer.used == Buffer::maxChunks)
+    return false;
+  size_t taken = reserved.load(std::memory_order_relaxed);
+  size_t size;
+  do {
+    size = std::min(Buffer::firstChunk << buffer.used, capacity - taken);
+    if (size == 0)
+      return false;
+  } while (!reserved.compare_exchange_weak(taken, taken + size,
+                                           std::memory_order_relaxed));
+  auto &chunk = buffer.chunks[buffer.used++];
+  chunk.spans.reset(new Span[size]);
+  chunk.size = size;
+  buffer.next = chunk.spans.get();
+  buffer.end = buffer.next + size;
+  return true;
+}
+
+void record(const char *name, int64_t begin, int64_t end) {
+  Buffer &buffer = local();
+  if (buffer.next == buffer.end && !grow(buffer)) {
+    buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  *buffer.next++ = {name, begin, end};
+  buffer.count.store(buffer.count.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+}
+
+// Names the calling thread in the trace. Unnamed threads are workers.
+void nameThread(const std::string &label) {
+  if (enabled.load(std::memory_order_relaxed))
+    local().label = label;
+}
+
+// Records the time from its construction to its destruction under name,
+// a string literal, while tracing is on. Otherwise costs one load.
+class Scope {
 public:
-  Image(const size_t &width, const size_t &height, bool isFilter = false)
-      : width(width), height(height), data_(width * height),
-        positions_(makePositions(isFilter)){};
+  explicit Scope(const char *name)
+      : name(enabled.load(std::memory_order_relaxed) ? name : nullptr),
+        begin(this->name ? now() : 0) {}
+  ~Scope() {
+    if (name)
+      record(name, begin, now());
+  }
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
 
-  Image(const Image &other)
-      : width(other.width), height(other.height),
-        data_(other.width * other.height) {
-    data_ = other.data_;
-    positions_ = other.positions_;
+private:
+  const char *name;
+  int64_t begin;
+};
+
+// Writes the spans recorded so far as Chrome trace events, which
+// chrome://tracing and Perfetto open, one track per thread.
+void write(std::ostream &out) {
+  std::lock_guard<std::mutex> lock(buffersLock);
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  const char *separator = "\n";
+  out << std::fixed << std::setprecision(3);
+  size_t dropped = 0;
+  for (const auto &buffer : buffers) {
+    const std::string label = buffer->label.empty()
+                                  ? "worker " + std::to_string(buffer->thread)
+                                  : buffer->label;
+    out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+        << "\"tid\":" << buffer->thread << ",\"args\":{\"name\":\"" << label
+        << "\"}}";
+    separator = ",\n";
+    // Chunks are filled in order, so the first n spans are published.
+    size_t n = buffer->count.load(std::memory_order_acquire);
+    for (const auto &chunk : buffer->chunks) {
+      if (n == 0)
+        break;
+      for (size_t i = 0; i < std::min(n, chunk.size); ++i) {
+        const Span &span = chunk.spans[i];
+        out << separator << "{\"name\":\"" << span.name
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread
+            << ",\"ts\":" << span.begin * 1e-3
+            << ",\"dur\":" << (span.end - span.begin) * 1e-3 << "}";
+      }
+      n -= std::min(n, chunk.size);
+    }
+    dropped += buffer->dropped.load(std::memory_order_relaxed);
+  }
+  out << "\n]}\n";
+  if (dropped)
+    std::cerr << "trace: dropped " << dropped << " spans past the capacity of "
+              << capacity << "\n";
+}
+
+// Traces from construction and writes the trace to path on destruction.
+// Does nothing if path is empty.
+class Capture {
+public:
+  explicit Capture(std::string path) : path(std::move(path)) {
+    if (this->path.empty())
+      return;
+    origin = std::chrono::steady_clock::now();
+    enabled = true;
+    nameThread("main");
+  }
+  ~Capture() {
+    if (path.empty())
+      return;
+    enabled = false;
+    std::ofstream out(path);
+    write(out);
+    std::cout << "Wrote trace to " << path << "\n";
+  }
+  Capture(const Capture &) = delete;
+  Capture &operator=(const Capture &) = delete;
+
+private:
+  std::string path;
+};
+} // namespace trace
+
+// How ghost cells outside the grid are filled: wrapped around, zero,
+// copies of the nearest edge cell, or mirrored about the edge cell.
+enum class Boundary { Periodic, Zero, Clamp, Reflect };
+
+// How conv2d computes a generation. The best plan depends on the machine,
+// the grid and the filter, see PixelBackEnd::autotune.
+struct ConvPlan {
+  // Direct sums all taps per cell. Separable applies a rank 1 filter as a
+  // row pass followed by a column pass, and falls back to Direct for other
+  // filters. Multiscale approximates the step on a grid coarsened by factor,
+  // see PixelBackEnd::planMultiscale. Shells approximates the filter by
+  // nested discs of constant weight summed from an integral image, see
+  // PixelBackEnd::planShells, and falls back to Direct for filters reaching
+  // past the halo. Sparse only sums the taps whose magnitude
+  // exceeds threshold times the largest one, see PixelBackEnd::planSparse.
+  // Winograd computes tiles of tile x tile cells with Winograd's minimal
+  // filtering algorithm, for square filters up to 7 x 7, and falls back to
+  // Direct for other filters.
+  enum class Method { Direct, Separable, Multiscale, Shells, Sparse, Winograd };
+  Method method = Method::Direct;
+  // Output rows per parallel task. Rounded up to even so every task fills
+  // whole level 1 rows of the pyramid.
+  size_t stripRows = 2;
+  // Worker threads, 0 for the default of one per core.
+  size_t threads = 0;
+  // Cells per coarse cell along each axis for Multiscale.
+  size_t factor = 1;
+  // Number of discs for Shells, and of rectangles each disc is built from.
+  size_t shells = 0;
+  size_t steps = 0;
+  // Relative magnitude below which Sparse drops a tap. Exact zeros are
+  // dropped even at 0.
+  double threshold = 0.0;
+  // Output tile size for Winograd, 0 for 4 with 3 x 3 filters and 2 with
+  // larger ones.
+  size_t tile = 0;
+  // How rules with growth apply their kernels. Combined applies each by the
+  // method above and combines their values cell by cell in one pass over
+  // the output, see Image::combinedConv2d. Fused applies all of them in one
+  // im2col and matrix product pass, see Image::fusedConv2d. Separate
+  // applies each by the method above in a pass of its own, then combines
+  // them in a last pass, see Image::separateConv2d.
+  enum class Rule { Combined, Fused, Separate };
+  Rule rule = Rule::Combined;
+
+  static constexpr const char *methodNames[] = {
+      "direct", "separable", "multiscale", "shells", "sparse", "winograd"};
+};
+
+std::ostream &operator<<(std::ostream &os, const ConvPlan &plan) {
+  return os << ConvPlan::methodNames[int(plan.method)] << " "
+            << plan.stripRows << " " << plan.threads << " " << plan.factor
+            << " " << plan.shells << " " << plan.steps << " "
+            << plan.threshold << " " << plan.tile << " " << int(plan.rule);
+}
+
+std::istream &operator>>(std::istream &is, ConvPlan &plan) {
+  std::string method;
+  plan.factor = 1;
+  plan.shells = 0;
+  plan.steps = 0;
+  plan.threshold = 0.0;
+  plan.tile = 0;
+  int rule = 0;
+  is >> method >> plan.stripRows >> plan.threads >> plan.factor >>
+      plan.shells >> plan.steps >> plan.threshold >> plan.tile >> rule;
+  plan.rule = ConvPlan::Rule(rule);
+  plan.method = ConvPlan::Method::Direct;
+  for (size_t m = 0; m < std::size(ConvPlan::methodNames); ++m) {
+    if (method == ConvPlan::methodNames[m])
+      plan.method = ConvPlan::Method(m);
   }
+  return is;
+}
+
+// An axis-aligned block [x0, x1] x [y0, y1] of filter offsets, inclusive,
+// whose cells are summed and weighted.
+struct WeightedBox {
+  long x0;
+  long y0;
+  long x1;
+  long y1;
+  double weight;
+};
 
-  Image(const size_t width, const size_t height,
-        std::vector<float> &&inData) noexcept
-      : width(width), height(height), positions_(makePositions()) {
-    data_ = std::move(inData);
+// The taps of a filter kept by a Sparse plan, grouped by row. Each run is a
+// row segment of consecutive kept taps at offsets dx .. dx + length - 1 and
+// dy from the filter center, whose weights start at weights[first], so a
+// cell reads every run as one contiguous load. Runs are ordered by dy, then
+// dx.
+template <typename C> struct SparseTaps {
+  struct Run {
+    long dx;
+    long dy;
+    size_t length;
+    size_t first;
   };
+  std::vector<Run> runs;
+  std::vector<C> weights;
+  // Taps of the whole filter, and the relative L2 and L1 norms of the
+  // dropped ones. The L1 one bounds the error of a step relative to the
+  // field.
+  size_t taps = 0;
+  double error = 0.0;
+  double l1Error = 0.0;
+};
 
-  Image &operator=(const Image &other) {
-    data_ = other.data_;
-    return *this;
+namespace winograd {
+// Winograd's minimal filtering algorithm F(m, r) correlates an r tap filter
+// g with n = m + r - 1 inputs d into m outputs as AT [(G g) * (BT d)],
+// with n multiplies instead of m r. The matrices are built by Toom-Cook
+// from the points 0, 1, -1, 2, -2, 1/2, -1/2 and infinity, which limits n
+// to 8; larger points lose too much precision in float. In two dimensions
+// a tile of m x m outputs is AT [(G g GT) * (BT d B)] A.
+struct Algorithm {
+  size_t m;
+  size_t r;
+  size_t n;
+  // Row major, AT m x n, G n x r and BT n x n.
+  std::vector<double> at;
+  std::vector<double> g;
+  std::vector<double> bt;
+};
+
+Algorithm minimal(size_t m, size_t r) {
+  const double points[] = {0.0, 1.0, -1.0, 2.0, -2.0, 0.5, -0.5};
+  const size_t n = m + r - 1;
+  Algorithm a{m, r, n, std::vector<double>(m * n), std::vector<double>(n * r),
+              std::vector<double>(n * n)};
+  // Coefficients of the product of (x - p) over the finite points p other
+  // than skip, lowest first.
+  const auto product = [&](size_t skip) {
+    std::vector<double> c{1.0};
+    for (size_t l = 0; l + 1 < n; ++l) {
+      if (l == skip)
+        continue;
+      c.push_back(0.0);
+      for (size_t k = c.size() - 1; k > 0; --k) {
+        c[k] = c[k - 1] - points[l] * c[k];
+      }
+      c[0] *= -points[l];
+    }
+    c.resize(n, 0.0);
+    return c;
+  };
+  // Row j evaluates at point j, and the last row takes the leading
+  // coefficient, the value at infinity. Interpolating the product back
+  // from the finite points divides by the product of their differences,
+  // which G absorbs.
+  for (size_t j = 0; j < n; ++j) {
+    const bool infinite = j + 1 == n;
+    double scale = 1.0;
+    for (size_t l = 0; !infinite && l + 1 < n; ++l) {
+      if (l != j)
+        scale *= points[j] - points[l];
+    }
+    for (size_t i = 0; i < m; ++i) {
+      a.at[i * n + j] = infinite ? i + 1 == m : std::pow(points[j], i);
+    }
+    for (size_t k = 0; k < r; ++k) {
+      a.g[j * r + k] =
+          infinite ? k + 1 == r : std::pow(points[j], k) / scale;
+    }
+    const auto c = product(infinite ? n : j);
+    std::copy(c.begin(), c.end(), a.bt.begin() + j * n);
   }
+  return a;
+}
+} // namespace winograd
 
-  const Image operator/(const float divisor) const {
-    Image out(width, height);
-    auto &outData = out.data_;
-    const auto &inData = read();
-    const auto divide = [&divisor](const float &dividend) -> float {
-      float result = dividend / divisor;
-      return result;
-    };
-    std::transform(inData.begin(), inData.end(), outData.begin(), divide);
-    return out;
+namespace gemm {
+// Register tile of the microkernel: MR rows of A by NR columns of B, whose
+// accumulators stay in vector registers.
+constexpr size_t MR = 4;
+constexpr size_t NR = 8;
+// Taps and columns per packed block of B, sized to stay in L2.
+constexpr size_t KC = 256;
+constexpr size_t NC = 128;
+
+// Packs rows [i0, i0 + MR) of a row major m x k matrix as k columns of MR
+// values, zero padded past row m.
+template <typename C>
+void packA(const C *a, size_t m, size_t k, size_t i0, C *panel) {
+  for (size_t p = 0; p < k; ++p) {
+    for (size_t i = 0; i < MR; ++i) {
+      panel[p * MR + i] = i0 + i < m ? a[(i0 + i) * k + p] : C(0);
+    }
+  }
+}
+
+// The first R rows of tile = a b over k, or tile += a b when accumulate is
+// set, with a packed as by packA and b as k rows of NR values. The fixed
+// trip counts of the inner loops let them vectorize.
+template <size_t R, typename C>
+void microkernel(size_t k, const C *a, const C *b, C *tile, bool accumulate) {
+  C acc[R][NR] = {};
+  for (size_t p = 0; p < k; ++p) {
+    for (size_t i = 0; i < R; ++i) {
+      for (size_t j = 0; j < NR; ++j) {
+        acc[i][j] += a[p * MR + i] * b[p * NR + j];
+      }
+    }
+  }
+  for (size_t i = 0; i < R; ++i) {
+    for (size_t j = 0; j < NR; ++j) {
+      tile[i * NR + j] = accumulate ? tile[i * NR + j] + acc[i][j] : acc[i][j];
+    }
+  }
+}
+
+// Runs the microkernel for one panel of A over the columns panels of a
+// packed block of B, each k rows of NR values.
+template <size_t R, typename C>
+void sweep(size_t columns, size_t k, const C *a, const C *block, C *tiles,
+           bool accumulate) {
+  for (size_t jp = 0; jp < columns; ++jp) {
+    microkernel<R>(k, a, block + jp * k * NR, tiles + jp * MR * NR,
+                   accumulate);
+  }
+}
+
+// Scratch space of multiply, kept by the caller so repeated products don't
+// reallocate it.
+template <typename C> struct Workspace {
+  std::vector<C> block;
+  std::vector<C> tiles;
+};
+
+// c (m x n, row stride ldc) = a b, with a given as the panels of packA for
+// every MR rows, and b (k x n) never stored: packB(p0, p1, j0, j1, block)
+// writes rows [p0, p1) of columns [j0, j1) into block as panels of NR
+// columns, each p1 - p0 rows of NR values, zero padded past j1.
+template <typename C, typename P>
+void multiply(size_t m, size_t n, size_t k, const std::vector<C> &a,
+              P &&packB, C *c, size_t ldc, Workspace<C> &work) {
+  const size_t panels = (m + MR - 1) / MR;
+  const size_t maxColumns = (std::min(n, NC) + NR - 1) / NR;
+  work.block.resize(std::max(work.block.size(),
+                             std::min(k, KC) * maxColumns * NR));
+  work.tiles.resize(
+      std::max(work.tiles.size(), panels * maxColumns * MR * NR));
+  C *tiles = work.tiles.data();
+  for (size_t j0 = 0; j0 < n; j0 += NC) {
+    const size_t j1 = std::min(j0 + NC, n);
+    const size_t columns = (j1 - j0 + NR - 1) / NR;
+    for (size_t p0 = 0; p0 < k; p0 += KC) {
+      const size_t p1 = std::min(p0 + KC, k);
+      packB(p0, p1, j0, j1, work.block.data());
+      for (size_t ip = 0; ip < panels; ++ip) {
+        const C *panel = &a[(ip * k + p0) * MR];
+        C *row = &tiles[ip * columns * MR * NR];
+        // The last panel only computes the rows it has.
+        switch (std::min(m - ip * MR, MR)) {
+        case 1:
+          sweep<1>(columns, p1 - p0, panel, work.block.data(), row, p0 > 0);
+          break;
+        case 2:
+          sweep<2>(columns, p1 - p0, panel, work.block.data(), row, p0 > 0);
+          break;
+        case 3:
+          sweep<3>(columns, p1 - p0, panel, work.block.data(), row, p0 > 0);
+          break;
+        default:
+          sweep<MR>(columns, p1 - p0, panel, work.block.data(), row, p0 > 0);
+        }
+      }
+    }
+    for (size_t i = 0; i < m; ++i) {
+      for (size_t j = j0; j < j1; ++j) {
+        const size_t jp = (j - j0) / NR;
+        c[i * ldc + j] = tiles[((i / MR * columns + jp) * MR + i % MR) * NR +
+                               (j - j0) % NR];
+      }
+    }
+  }
+}
+} // namespace gemm
+
+// Layout policies decide how an Image arranges its cells in memory. A policy
+// is built for the padded extent of the image and splits the storage offset
+// of a cell into a part for its padded column and a part for its padded row.
+
+// Stores rows one after another like olc::Sprite.
+struct RowMajor {
+  // Whether the cells of a row are adjacent in storage.
+  static constexpr bool contiguousRows = true;
+
+  RowMajor(size_t width, size_t height) : stride(width), height(height) {}
+
+  size_t xOffset(size_t x) const noexcept { return x; }
+  size_t yOffset(size_t y) const noexcept { return y * stride; }
+  size_t size() const noexcept { return stride * height; }
+
+  const size_t stride;
+  const size_t height;
+};
+
+// Stores 4 x 4 cell tiles of one cache line each, in Z-order within 64 x 64
+// cell blocks, so the cells of a square neighbourhood share few cache lines
+// and pages.
+class Tiled {
+public:
+  static constexpr bool contiguousRows = false;
+
+  Tiled(size_t width, size_t height)
+      : blocksPerRow((width + blockSize - 1) / blockSize),
+        blockRows((height + blockSize - 1) / blockSize),
+        xOffsets_(makeOffsets(width, true)),
+        yOffsets_(makeOffsets(height, false)) {}
+
+  size_t xOffset(size_t x) const noexcept { return xOffsets_[x]; }
+  size_t yOffset(size_t y) const noexcept { return yOffsets_[y]; }
+  size_t size() const noexcept {
+    return blockRows * blocksPerRow * blockSize * blockSize;
   }
 
-  float average() {
-    auto sum = std::reduce(std::begin(data_), std::end(data_), 0.0f);
-    return sum / data_.size();
+private:
+  static constexpr size_t tileSize = 4;
+  static constexpr size_t blockSize = 64;
+
+  size_t blocksPerRow;
+  size_t blockRows;
+  std::vector<size_t> xOffsets_;
+  std::vector<size_t> yOffsets_;
+
+  // Spreads the bits of i apart so they occupy the even bit positions.
+  static size_t spreadBits(size_t i) {
+    size_t result = 0;
+    for (size_t bit = 0; (i >> bit) != 0; ++bit) {
+      result |= ((i >> bit) & 1) << (2 * bit);
+    }
+    return result;
   }
 
-  const Image operator*(const float &factor) const {
-    Image out(width, height);
-    auto &outData = out.data_;
-    const auto &inData = read();
-    std::transform(inData.begin(), inData.end(), std::begin(outData),
-                   [&factor](float f) -> float { return f * factor; });
-    return out;
+  std::vector<size_t> makeOffsets(size_t extent, bool horizontal) const {
+    std::vector<size_t> offsets(extent);
+    for (size_t i = 0; i < extent; ++i) {
+      const size_t block = i / blockSize;
+      const size_t tile = (i % blockSize) / tileSize;
+      const size_t cell = i % tileSize;
+      const size_t blockCells = blockSize * blockSize;
+      const size_t tileCells = tileSize * tileSize;
+      offsets[i] =
+          horizontal ? block * blockCells + spreadBits(tile) * tileCells + cell
+                     : block * blocksPerRow * blockCells +
+                           (spreadBits(tile) << 1) * tileCells +
+                           cell * tileSize;
+    }
+    return offsets;
   }
+};
+
+// The type arithmetic on cells of type T is carried out in, and how a result
+// is stored back into a cell.
+template <typename T> struct CellTraits {
+  using Compute = T;
+  static T store(Compute value) { return value; }
+};
 
-  const Image operator+(const float &factor) const {
-    Image out(width, height);
-    auto &outData = out.data_;
-    const auto &inData = read();
-    std::transform(inData.begin(), inData.end(), std::begin(outData),
-                   [&factor](float f) -> float { return f + factor; });
-    return out;
+// Fixed point cells are computed in float and rounded, saturating at the
+// limits of the type.
+template <> struct CellTraits<int16_t> {
+  using Compute = float;
+  static int16_t store(float value) {
+    return int16_t(std::clamp(std::nearbyint(value),
+                              float(std::numeric_limits<int16_t>::min()),
+                              float(std::numeric_limits<int16_t>::max())));
   }
+};
+
+#if defined(__FLT16_MAX__)
+// Half precision cells are computed in float and rounded when stored.
+template <> struct CellTraits<_Float16> {
+  using Compute = float;
+  static _Float16 store(float value) { return _Float16(value); }
+};
+#endif
+
+// Min, max and mean of a block of cells.
+struct Summary {
+  float min;
+  float max;
+  float mean;
+};
+
+class Pyramid;
+template <typename T = float, typename Layout = RowMajor> class Image;
+
+// Arithmetic on Images is evaluated lazily: the operators below only build
+// ImageExpr nodes, and assigning the finished expression to an Image runs
+// the whole chain in a single loop without intermediate images.
+template <typename V> struct ScalarOperand {
+  V value;
+  V operator[](size_t) const { return value; }
+};
+
+template <typename E> struct IsImage : std::false_type {};
+template <typename T, typename Layout>
+struct IsImage<Image<T, Layout>> : std::true_type {};
+
+template <typename Op, typename L, typename R> class ImageExpr {
+public:
+  using Compute = typename L::Compute;
+  using LayoutType = typename L::LayoutType;
+
+  ImageExpr(const L &lhs, const R &rhs, size_t width, size_t height,
+            size_t halo)
+      : width(width), height(height), halo(halo), lhs(lhs), rhs(rhs) {}
+
+  // Indexes storage, so Image operands must share the same layout.
+  Compute operator[](size_t i) const { return Op()(lhs[i], rhs[i]); }
+
+  const size_t width;
+  const size_t height;
+  const size_t halo;
 
-  const Image operator-(const float &factor) const {
-    Image out(width, height);
-    auto &outData = out.data_;
-    const auto &inData = read();
-    std::transform(inData.begin(), inData.end(), std::begin(outData),
-                   [&factor](float f) -> float { return f - factor; });
-    return out;
+private:
+  // Images are referenced, expression nodes are small and copied.
+  std::conditional_t<IsImage<L>::value, const L &, const L> lhs;
+  std::conditional_t<IsImage<R>::value, const R &, const R> rhs;
+};
+
+template <typename E> struct IsImageExpr : IsImage<E> {};
+template <typename Op, typename L, typename R>
+struct IsImageExpr<ImageExpr<Op, L, R>> : std::true_type {};
+
+template <typename Op, typename E>
+using ImageScalarExpr =
+    std::enable_if_t<IsImageExpr<E>::value,
+                     ImageExpr<Op, E, ScalarOperand<typename E::Compute>>>;
+
+template <typename Op, typename L, typename R>
+using ImageImageExpr = std::enable_if_t<
+    IsImageExpr<L>::value && IsImageExpr<R>::value &&
+        std::is_same_v<typename L::LayoutType, typename R::LayoutType>,
+    ImageExpr<Op, L, R>>;
+
+template <typename E>
+ImageScalarExpr<std::plus<>, E> operator+(const E &e,
+                                          typename E::Compute value) {
+  return {e, {value}, e.width, e.height, e.halo};
+}
+
+template <typename E>
+ImageScalarExpr<std::minus<>, E> operator-(const E &e,
+                                           typename E::Compute value) {
+  return {e, {value}, e.width, e.height, e.halo};
+}
+
+template <typename E>
+ImageScalarExpr<std::multiplies<>, E> operator*(const E &e,
+                                                typename E::Compute factor) {
+  return {e, {factor}, e.width, e.height, e.halo};
+}
+
+template <typename E>
+ImageScalarExpr<std::divides<>, E> operator/(const E &e,
+                                             typename E::Compute divisor) {
+  return {e, {divisor}, e.width, e.height, e.halo};
+}
+
+// Operands are indexed by storage position, so they must agree on extent
+// and halo.
+template <typename L, typename R>
+bool sameShape(const L &lhs, const R &rhs) {
+  return lhs.width == rhs.width && lhs.height == rhs.height &&
+         lhs.halo == rhs.halo;
+}
+
+template <typename L, typename R>
+ImageImageExpr<std::plus<>, L, R> operator+(const L &lhs, const R &rhs) {
+  assert(sameShape(lhs, rhs));
+  return {lhs, rhs, lhs.width, lhs.height, lhs.halo};
+}
+
+template <typename L, typename R>
+ImageImageExpr<std::minus<>, L, R> operator-(const L &lhs, const R &rhs) {
+  assert(sameShape(lhs, rhs));
+  return {lhs, rhs, lhs.width, lhs.height, lhs.halo};
+}
+
+template <typename L, typename R>
+ImageImageExpr<std::multiplies<>, L, R> operator*(const L &lhs,
+                                                  const R &rhs) {
+  assert(sameShape(lhs, rhs));
+  return {lhs, rhs, lhs.width, lhs.height, lhs.halo};
+}
+
+// A grid of cells of type T arranged in memory by the Layout policy.
+// Arithmetic on the cells is done in CellTraits<T>::Compute.
+template <typename T, typename Layout> class Image {
+public:
+  using Cell = T;
+  using Compute = typename CellTraits<T>::Compute;
+  using LayoutType = Layout;
+  // Filters are small, so they are always RowMajor and hold Compute values.
+  using Filter = Image<Compute, RowMajor>;
+
+  // An image may be surrounded by a halo of ghost cells, filled by
+  // fillHalo, so stencils reaching up to halo cells past an edge need no
+  // index wrapping.
+  Image(const size_t &width, const size_t &height, size_t halo = 0)
+      : width(width), height(height), halo(halo), stride(width + 2 * halo),
+        layout_(width + 2 * halo, height + 2 * halo), data_(layout_.size()){};
+
+  Image(const Image &other)
+      : width(other.width), height(other.height), halo(other.halo),
+        stride(other.stride), layout_(other.layout_), data_(other.data_) {}
+
+  Image(Image &&other) noexcept
+      : width(other.width), height(other.height), halo(other.halo),
+        stride(other.stride), layout_(other.layout_),
+        data_(std::move(other.data_)) {}
+
+  // The shape is fixed at construction, so only images of the same shape
+  // can be assigned.
+  Image &operator=(const Image &other) {
+    assert(sameShape(*this, other));
+    data_ = other.data_;
+    return *this;
   }
 
-  Image &operator=(const Image &&other) noexcept {
+  Image &operator=(Image &&other) noexcept {
+    assert(sameShape(*this, other));
     data_ = std::move(other.data_);
     return *this;
   }
 
-  friend std::ostream &operator<<(std::ostream &os, const Image &image);
+  template <typename Op, typename L, typename R>
+  Image(const ImageExpr<Op, L, R> &expr)
+      : Image(expr.width, expr.height, expr.halo) {
+    assign(expr);
+  }
+
+  template <typename Op, typename L, typename R>
+  Image &operator=(const ImageExpr<Op, L, R> &expr) {
+    assign(expr);
+    return *this;
+  }
+
+  Compute sum() const {
+    if (halo == 0 && Layout::contiguousRows) {
+      return std::transform_reduce(std::execution::par_unseq,
+                                   std::begin(data_), std::end(data_),
+                                   Compute(0), std::plus<Compute>(),
+                                   [](T cell) { return Compute(cell); });
+    }
+    return std::transform_reduce(
+        std::execution::par, boost::counting_iterator<size_t>(0),
+        boost::counting_iterator<size_t>(height), Compute(0),
+        std::plus<Compute>(), [this](size_t y) {
+          Compute total = 0;
+          for (size_t x = 0; x < width; ++x) {
+            total += get(x, y);
+          }
+          return total;
+        });
+  }
+
+  Compute average() const { return sum() / (width * height); }
+
+  Image &operator+=(Compute value) { return *this = *this + value; }
+  Image &operator-=(Compute value) { return *this = *this - value; }
+  Image &operator*=(Compute factor) { return *this = *this * factor; }
+  Image &operator/=(Compute divisor) { return *this = *this / divisor; }
+
+  Compute operator[](size_t i) const { return data_[i]; }
+
   const size_t width;
   const size_t height;
+  const size_t halo;
+  // Distance in cells between vertically adjacent cells of a RowMajor image.
+  const size_t stride;
 
   struct Index {
     Index(size_t x, size_t y) : x(x), y(y){};
@@ -119,266 +868,3927 @@ public:
     return (x >= width || y >= height);
   };
 
-  const std::vector<float> &read() const { return data_; }
+  // Raw storage, including any ghost cells.
+  const std::vector<T> &read() const { return data_; }
 
+  // x is the column and y the row.
   const Index getIndex(const uint i) const {
-    return Index(i / width, i % height);
+    return Index(i % width, i / width);
+  }
+
+  void set(const Index &idx, Compute value) noexcept {
+    data_[offset(idx.x, idx.y)] = CellTraits<T>::store(value);
+  }
+
+  void set(size_t x, size_t y, Compute value) noexcept {
+    data_[offset(x, y)] = CellTraits<T>::store(value);
+  }
+
+  void add(size_t x, size_t y, Compute value) noexcept {
+    T &cell = data_[offset(x, y)];
+    cell = CellTraits<T>::store(cell + value);
   }
 
-  void set(const Index &idx, float value) noexcept {
-    data_[idx.x * width + idx.y] = value;
+  void mult(size_t x, size_t y, Compute factor) noexcept {
+    T &cell = data_[offset(x, y)];
+    cell = CellTraits<T>::store(cell * factor);
   }
 
-  void set(size_t x, size_t y, float value) noexcept {
-    data_[x * width + y] = value;
+  [[nodiscard]] Compute get(const Index &idx) const noexcept {
+    return data_[offset(idx.x, idx.y)];
   }
 
-  void add(size_t x, size_t y, float value) noexcept {
-    data_[x * width + y] +=  value;
+  [[nodiscard]] Compute get(size_t x, size_t y) const noexcept {
+    return data_[offset(x, y)];
   }
 
-  void mult(size_t x, size_t y, float factor) noexcept {
-    data_[(x * width) + y] *=  factor;
-    //std::cout << "Setting " << x << ":" << y << " to: " << factor << "\n";
-    //std::cout << "abs: " <<  (x * width) + y << "\n";
+  // First cell of row y. The halo extends the row to either side and the
+  // rows above and below it are stride cells away. Null unless the layout
+  // has contiguous rows.
+  const T *row(size_t y) const noexcept {
+    if constexpr (Layout::contiguousRows)
+      return &data_[offset(0, y)];
+    return nullptr;
   }
 
-  [[nodiscard]] float get(const Index &idx) const noexcept {
-    return data_[idx.x * width + idx.y];
+  // Storage offset of a cell, where coordinates down to -halo and up to
+  // width/height + halo - 1 address ghost cells. Equal to xOffset(x) +
+  // yOffset(y).
+  size_t offset(long x, long y) const noexcept {
+    return xOffset(x) + yOffset(y);
   }
+  size_t xOffset(long x) const noexcept { return layout_.xOffset(x + halo); }
+  size_t yOffset(long y) const noexcept { return layout_.yOffset(y + halo); }
+  const T *storage() const noexcept { return data_.data(); }
 
-  [[nodiscard]] float get(size_t x, size_t y) noexcept {
-    return data_[x * width + y];
+  // Fills the ghost cells from the grid according to the boundary policy.
+  void fillHalo(Boundary boundary) {
+    if (halo == 0)
+      return;
+    const long w = width;
+    const long h = height;
+    const long pad = halo;
+    const auto source = [boundary](long i, long n) -> long {
+      switch (boundary) {
+      case Boundary::Clamp:
+        return std::clamp(i, 0L, n - 1);
+      case Boundary::Reflect: {
+        if (n == 1)
+          return 0;
+        const long period = 2 * (n - 1);
+        const long m = ((i % period) + period) % period;
+        return m < n ? m : period - m;
+      }
+      default:
+        return ((i % n) + n) % n;
+      }
+    };
+    const auto fill = [&](long x, long y) {
+      data_[offset(x, y)] = boundary == Boundary::Zero
+                                ? T(0)
+                                : data_[offset(source(x, w), source(y, h))];
+    };
+    for (long y = 0; y < h; ++y) {
+      for (long x = -pad; x < 0; ++x) {
+        fill(x, y);
+      }
+      for (long x = w; x < w + pad; ++x) {
+        fill(x, y);
+      }
+    }
+    for (long y = -pad; y < h + pad; ++y) {
+      if (y == 0)
+        y = h;
+      for (long x = -pad; x < w + pad; ++x) {
+        fill(x, y);
+      }
+    }
   }
 
-  const std::vector<Index> makePositions(bool relative = false) const {
-    std::vector<Index> v(width * height);
-    int i = 0;
-    for (auto &position : v) {
-      position = getIndex(i++);
-      if (relative) {
-        position.x -= width / 2;
-        position.y -= height / 2;
+  // Min, max and mean over the block [x, x + w) x [y, y + h), clipped to the
+  // image.
+  Summary summarize(size_t x, size_t y, size_t w, size_t h) const noexcept {
+    const size_t xEnd = std::min(x + w, width);
+    const size_t yEnd = std::min(y + h, height);
+    Summary s{float(get(x, y)), float(get(x, y)), 0.0f};
+    for (size_t j = y; j < yEnd; ++j) {
+      for (size_t i = x; i < xEnd; ++i) {
+        const float value = get(i, j);
+        s.min = std::min(s.min, value);
+        s.max = std::max(s.max, value);
+        s.mean += value;
       }
     }
-    return v;
+    s.mean /= (xEnd - x) * (yEnd - y);
+    return s;
   }
 
-  const std::vector<Index> &getPositions() const { return positions_; }
+  // Heap memory held by the image.
+  size_t bytes() const { return data_.capacity() * sizeof(T); }
+
   void setZero() {
     for (auto &pixel : data_) {
-      pixel = 0.0f;
+      pixel = T(0);
     }
   }
 
-  static Image conv2d(const Image &input, const Image &filter) {
-    Image result(input.height, input.width);
-    auto &outData = result.data_;
-    const auto &inputPositions = input.getPositions();
-    std::transform(
-        std::execution::par, std::begin(inputPositions),
-        std::end(inputPositions), std::begin(outData),
-        [&](auto pos) -> float { return getConvPixel(input, pos, filter); });
-    return result;
+  // When a pyramid is given its coarse levels are refreshed from the result
+  // in the same pass. When a frame is given the cells inside it are also
+  // colour mapped into it as they are computed, and when stats is given it
+  // receives the reductions of the result.
+  static Image conv2d(const Image &input, const Filter &filter,
+                      Pyramid *pyramid = nullptr,
+                      const FrameTarget *frame = nullptr,
+                      FieldStats *stats = nullptr,
+                      const ConvPlan &plan = ConvPlan());
+
+  // Convolves input with every filter in one pass. The filters are centered
+  // on their union footprint, and a step is the product of the filters'
+  // taps with the cells under every tap (im2col), computed by gemm so each
+  // block of input cells is read once for all filters. Taps that are zero
+  // in every filter are skipped. The input's halo has to be filled, and
+  // when it doesn't cover the filters the input wraps around its edges as
+  // for a single filter.
+  static std::vector<Image<Compute>>
+  conv2d(const Image &input, const std::vector<Filter> &filters,
+         const ConvPlan &plan = ConvPlan());
+
+  // Applies the filters in one pass as conv2d does, and sets each cell of
+  // the result to combine(values), where values[i] is the cell's value
+  // for filter i. The pyramid, frame and stats are fed as by conv2d.
+  template <typename F>
+  static Image fusedConv2d(const Image &input,
+                           const std::vector<Filter> &filters, F &&combine,
+                           Pyramid *pyramid = nullptr,
+                           const FrameTarget *frame = nullptr,
+                           FieldStats *stats = nullptr,
+                           const ConvPlan &plan = ConvPlan());
+
+  // Applies every filter as conv2d does with plan, each by the plan's own
+  // method, and sets each cell of the result to combine(values) as
+  // fusedConv2d does, in one pass over the output. values[i] is computed
+  // when combine reads it.
+  template <typename F>
+  static Image combinedConv2d(const Image &input,
+                              const std::vector<Filter> &filters,
+                              F &&combine, Pyramid *pyramid = nullptr,
+                              const FrameTarget *frame = nullptr,
+                              FieldStats *stats = nullptr,
+                              const ConvPlan &plan = ConvPlan());
+
+  // As combinedConv2d, but applies each filter in a pass of its own into
+  // passes, then combines their values in a last pass over the output. The
+  // passes can be kept between calls to save reallocating them.
+  template <typename F>
+  static Image separateConv2d(const Image &input,
+                              const std::vector<Filter> &filters,
+                              F &&combine, std::vector<Compute> &passes,
+                              Pyramid *pyramid = nullptr,
+                              const FrameTarget *frame = nullptr,
+                              FieldStats *stats = nullptr,
+                              const ConvPlan &plan = ConvPlan());
+
+  // Means of the factor x factor blocks of cells, clipped to the image, in a
+  // RowMajor image with a halo of the given width left for fillHalo.
+  Image<Compute> downsample(size_t factor, size_t coarseHalo) const {
+    Image<Compute> coarse((width + factor - 1) / factor,
+                          (height + factor - 1) / factor, coarseHalo);
+    std::for_each(
+        std::execution::par, boost::counting_iterator<size_t>(0),
+        boost::counting_iterator<size_t>(coarse.height), [&](size_t cy) {
+          const size_t yEnd = std::min((cy + 1) * factor, height);
+          for (size_t cx = 0; cx < coarse.width; ++cx) {
+            const size_t xEnd = std::min((cx + 1) * factor, width);
+            Compute sum = 0;
+            for (size_t y = cy * factor; y < yEnd; ++y) {
+              for (size_t x = cx * factor; x < xEnd; ++x) {
+                sum += get(x, y);
+              }
+            }
+            coarse.set(cx, cy, sum / ((xEnd - cx * factor) *
+                                      (yEnd - cy * factor)));
+          }
+        });
+    return coarse;
   }
 
-private:
-  std::vector<float> data_;
-  std::vector<Index> positions_;
-  static float getConvPixel(const Image &input, const Image::Index &pos,
-                            const Image &filter) {
-    std::vector<float> results(filter.read().size());
-    const auto &filterData = filter.read();
-    auto positions = filter.getPositions();
-    const int w = input.width;
-    const int h = input.height;
-    std::for_each(std::begin(positions), std::end(positions),
-                  [&pos, &w, &h](Index &index) {
-                    index.x = (index.x + pos.x) % w;
-                    index.y = (index.y + pos.y) % h;
-                  });
-    const auto beginnings = boost::make_zip_iterator(
-        boost::make_tuple(std::begin(filterData), std::begin(positions)));
-    const auto ends = boost::make_zip_iterator(
-        boost::make_tuple(std::end(filterData), std::end(positions)));
-    std::transform(beginnings, ends, std::begin(results),
-                   [&](const auto &valuePosPair) {
-                     return boost::get<0>(valuePosPair) *
-                            input.get(boost::get<1>(valuePosPair));
-                   });
-    const auto result =
-        std::reduce(std::begin(results), std::end(results), 0.0f);
-    return result;
+  // Sums every box around each cell of input, scaled by its weight, from an
+  // integral image of the padded input, so the cost per cell only depends on
+  // the number of boxes. The halo has to cover the boxes and be filled. The
+  // integral image is built in table, which can be kept between calls to
+  // save reallocating it. The pyramid, frame and stats are fed as by conv2d.
+  static Image boxSums(const Image &input,
+                       const std::vector<WeightedBox> &boxes,
+                       std::vector<double> &table,
+                       Pyramid *pyramid = nullptr,
+                       const FrameTarget *frame = nullptr,
+                       FieldStats *stats = nullptr,
+                       const ConvPlan &plan = ConvPlan());
+
+  // Inverse of downsample: interpolates a coarse image bilinearly between
+  // the centers of its cells. The coarse halo has to be at least one cell
+  // wide and filled. The pyramid, frame and stats are fed as by conv2d.
+  static Image upsample(const Image<Compute> &coarse, size_t factor,
+                        size_t width, size_t height, size_t halo,
+                        Pyramid *pyramid = nullptr,
+                        const FrameTarget *frame = nullptr,
+                        FieldStats *stats = nullptr,
+                        const ConvPlan &plan = ConvPlan());
+
+  // Extracts the taps weights[dy * (r + 1) + dx], 0 <= dy <= dx <= r, of a
+  // square filter of radius r that is unchanged by the reflections and
+  // rotations of the square. Returns false for other filters.
+  static bool fold(const Filter &filter, std::vector<Compute> &weights) {
+    const long r = filter.width / 2;
+    if (filter.width != filter.height || filter.width % 2 == 0)
+      return false;
+    const auto tap = [&](long dx, long dy) { return filter.get(r + dx, r + dy); };
+    weights.assign((r + 1) * (r + 1), 0);
+    for (long dy = 0; dy <= r; ++dy) {
+      for (long dx = dy; dx <= r; ++dx) {
+        const Compute w = tap(dx, dy);
+        for (const auto &[x, y] : {std::pair{dx, dy}, {-dx, dy}, {dx, -dy},
+                                   {-dx, -dy}, {dy, dx}, {-dy, dx},
+                                   {dy, -dx}, {-dy, -dx}}) {
+          if (tap(x, y) != w)
+            return false;
+        }
+        weights[dy * (r + 1) + dx] = w;
+      }
+    }
+    return true;
   }
-};
 
-class PixelBackEnd {
-public:
-  PixelBackEnd(size_t width, size_t height, size_t convSize)
-      : image(width, height), filter(convSize, convSize, true){};
-  void step() { image = Image::conv2d(image, filter); }
-  float get(size_t x, size_t y) const { return image.get(Image::Index(x, y)); }
-  void setFilter(Image f) { filter = f; }
-  void setZero() { image.setZero(); }
-  void add(size_t x, size_t y) { image.add(x, y, MOUSE_ADD); }
-  void mult(size_t x, size_t y) { image.mult(x, y, MOUSE_MULT); }
+  // Drops the taps of a filter whose magnitude is at most threshold times
+  // the largest one and groups the rest into runs.
+  static SparseTaps<Compute> sparsify(const Filter &filter,
+                                      double threshold) {
+    SparseTaps<Compute> sparse;
+    sparse.taps = filter.width * filter.height;
+    double peak = 0.0;
+    double l1 = 0.0;
+    double l2 = 0.0;
+    for (size_t y = 0; y < filter.height; ++y) {
+      for (size_t x = 0; x < filter.width; ++x) {
+        const double w = std::fabs(double(filter.get(x, y)));
+        peak = std::max(peak, w);
+        l1 += w;
+        l2 += w * w;
+      }
+    }
+    const long rx = filter.width / 2;
+    const long ry = filter.height / 2;
+    for (size_t y = 0; y < filter.height; ++y) {
+      bool open = false;
+      for (size_t x = 0; x < filter.width; ++x) {
+        const Compute w = filter.get(x, y);
+        if (std::fabs(double(w)) <= threshold * peak) {
+          sparse.error += double(w) * w;
+          sparse.l1Error += std::fabs(double(w));
+          open = false;
+          continue;
+        }
+        if (!open)
+          sparse.runs.push_back({long(x) - rx, long(y) - ry, 0,
+                                 sparse.weights.size()});
+        open = true;
+        ++sparse.runs.back().length;
+        sparse.weights.push_back(w);
+      }
+    }
+    sparse.error = l2 > 0.0 ? std::sqrt(sparse.error / l2) : 0.0;
+    sparse.l1Error = l1 > 0.0 ? sparse.l1Error / l1 : 0.0;
+    return sparse;
+  }
 
-  // Places a point with a given value in the middle of the canvas.
-  void seed(float sum) {
-    bool horizontalOdd = image.width % 2;
-    bool verticalOdd = image.height % 2;
-    if (horizontalOdd) {
-      if (verticalOdd) {
-        Image::Index idx(image.width / 2, image.height / 2);
-        image.set(idx, sum);
-      } else {
-        image.set(image.width / 2, image.height / 2, sum / 2.0f);
-        image.set(image.width / 2, (image.height / 2) + 1, sum / 2.0f);
+  // Splits a rank 1 filter into column and row factors whose outer product
+  // it is. Returns false when the filter is not rank 1.
+  static bool factorize(const Filter &filter, std::vector<Compute> &columns,
+                        std::vector<Compute> &rows) {
+    size_t px = 0;
+    size_t py = 0;
+    Compute peak = 0;
+    for (size_t y = 0; y < filter.height; ++y) {
+      for (size_t x = 0; x < filter.width; ++x) {
+        if (std::fabs(filter.get(x, y)) > std::fabs(peak)) {
+          peak = filter.get(x, y);
+          px = x;
+          py = y;
+        }
       }
-    } else {
-      if (verticalOdd) {
-        image.set(image.width / 2, (image.height / 2) + 1, sum / 2.0f);
-        image.set(image.width / 2, image.height / 2, sum / 2.0f);
-      } else {
-        image.set(image.width / 2, image.height / 2, sum / 4.0f);
-        image.set(image.width / 2, (image.height / 2) + 1, sum / 4.0f);
-        image.set((image.width / 2) + 1, image.height / 2, sum / 4.0f);
-        image.set((image.width / 2) + 1, (image.height / 2) + 1, sum / 4.0f);
+    }
+    if (peak == 0)
+      return false;
+    columns.resize(filter.height);
+    rows.resize(filter.width);
+    for (size_t y = 0; y < filter.height; ++y) {
+      columns[y] = filter.get(px, y) / peak;
+    }
+    for (size_t x = 0; x < filter.width; ++x) {
+      rows[x] = filter.get(x, py);
+    }
+    for (size_t y = 0; y < filter.height; ++y) {
+      for (size_t x = 0; x < filter.width; ++x) {
+        if (std::fabs(filter.get(x, y) - columns[y] * rows[x]) >
+            1e-6f * std::fabs(peak))
+          return false;
       }
     }
+    return true;
   }
 
 private:
-  Image image;
-  Image filter;
-};
+  Layout layout_;
+  std::vector<T> data_;
+
+  // Builds an image strip by strip for conv2d and upsample. strip(y0, y1)
+  // prepares rows [y0, y1) and returns the function giving the value of
+  // each of their cells.
+  template <typename S>
+  static Image generate(size_t width, size_t height, size_t halo, S &&strip,
+                        Pyramid *pyramid, const FrameTarget *frame,
+                        FieldStats *stats, const ConvPlan &plan);
+
+  class Convolution;
+
+  // Filters as the rows of a matrix over the offsets some filter uses,
+  // packed for gemm.
+  struct Stack {
+    std::vector<std::pair<long, long>> offsets;
+    std::vector<Compute> packed;
+    size_t filters = 0;
+    // Half the larger side of the union footprint.
+    size_t reach = 0;
+  };
+  static Stack stack(const std::vector<Filter> &filters);
+  // Values of every stacked filter for the cells of row y, as
+  // values[i * width + x]. Inputs whose halo is narrower than the stack's
+  // reach wrap around their edges as conv2d does.
+  static void stackedRow(const Image &input, const Stack &stack, size_t y,
+                         Compute *values, gemm::Workspace<Compute> &work);
+
+  // Evaluates an element-wise expression into data_. Every element only
+  // reads its own index, so the expression may refer to this image.
+  template <typename E> void assign(const E &expr) {
+    static_assert(std::is_same_v<typename E::LayoutType, Layout>,
+                  "expression operands must share the image's layout");
+    assert(sameShape(*this, expr));
+    std::transform(std::execution::par_unseq,
+                   boost::counting_iterator<size_t>(0),
+                   boost::counting_iterator<size_t>(data_.size()),
+                   std::begin(data_),
+                   [&expr](size_t i) { return CellTraits<T>::store(expr[i]); });
+  }
+  // Filter taps are taken relative to the filter center. The input's halo
+  // has to cover the filter radius and be filled.
+  static Compute getPaddedConvPixel(const Image &input, const Index &pos,
+                                    const Filter &filter) {
+    const T *window = input.row(pos.y) -
+                      long(filter.height / 2) * long(input.stride) + pos.x -
+                      long(filter.width / 2);
+    return getWindowConvPixel(window, input.stride, filter);
+  }
 
-std::ostream &operator<<(std::ostream &os, const Image &image) {
-  size_t counter = 0;
-  for (const auto &pixel : image.read()) {
-    os << pixel << ", ";
-    ++counter;
-    if (counter >= image.width) {
-      counter = 0;
+  // Sums the taps of filter over the cells of a row-major window whose
+  // top left corner is window.
+  static Compute getWindowConvPixel(const T *window, size_t stride,
+                                    const Filter &filter) {
+    const int fw = filter.width;
+    const int fh = filter.height;
+    Compute result = 0;
+    for (int fy = 0; fy < fh; ++fy) {
+      const Compute *taps = filter.row(fy);
+      const T *cells = window + fy * long(stride);
+      for (int fx = 0; fx < fw; ++fx) {
+        result += taps[fx] * cells[fx];
+      }
     }
+    return result;
   }
-  return os;
-}
 
-namespace filters {
-Image normalize(const Image &filter) {
-  float sum = 0.0f;
-  auto data = filter.read();
-  sum = std::reduce(data.begin(), data.end(), 0.0f);
-  return filter / sum;
-}
+  // Copies the cells that a filter of fw x fh taps reads for the rows
+  // [y0, y1) into a row-major window of width + fw - 1 columns, starting at
+  // cell (-fw / 2, y0 - fh / 2). Layouts without contiguous rows then look
+  // up the offset of each cell once per strip rather than once per tap.
+  static std::vector<T> gatherRows(const Image &input, size_t y0, size_t y1,
+                                   long fw, long fh) {
+    const long columns = long(input.width) + fw - 1;
+    const long rows = long(y1 - y0) + fh - 1;
+    std::vector<T> window(columns * rows);
+    std::vector<size_t> xOffsets(columns);
+    for (long i = 0; i < columns; ++i) {
+      xOffsets[i] = input.xOffset(i - fw / 2);
+    }
+    for (long j = 0; j < rows; ++j) {
+      const T *cells = input.storage() + input.yOffset(long(y0) + j - fh / 2);
+      T *out = &window[j * columns];
+      for (long i = 0; i < columns; ++i) {
+        out[i] = cells[xOffsets[i]];
+      }
+    }
+    return window;
+  }
 
-Image circular(size_t size, float gain) {
-  Image filter(size, size);
-  float center = 0;
-  for (int x = 0; x < size; ++x) {
-    for (int y = 0; y < size; ++y) {
-      const int rx = x - size / 2;
-      const int ry = y - size / 2;
-      float centerDistance = distance({center, center}, {rx, ry});
-      filter.set(x, y, 1.0f / (1 + centerDistance));
+  // As getPaddedConvPixel, but wraps around the edges of an input without a
+  // sufficient halo.
+  static Compute getConvPixel(const Image &input, const Index &pos,
+                              const Filter &filter) {
+    const int w = input.width;
+    const int h = input.height;
+    const int fw = filter.width;
+    const int fh = filter.height;
+    Compute result = 0;
+    for (int fy = 0; fy < fh; ++fy) {
+      const size_t y = (pos.y + fy - fh / 2 + h) % h;
+      for (int fx = 0; fx < fw; ++fx) {
+        const size_t x = (pos.x + fx - fw / 2 + w) % w;
+        result += filter.get(fx, fy) * input.get(x, y);
+      }
     }
+    return result;
   }
-  filter = normalize(filter);
-  return filter * gain;
-}
+};
 
-Image ring(size_t size, float gain) {
-  Image filter(size, size);
-  float center = 0;
-  for (int x = 0; x < size; ++x) {
-    for (int y = 0; y < size; ++y) {
-      const int rx = x - size / 2;
-      const int ry = y - size / 2;
-      float centerDistance = distance({center, center}, {rx, ry});
-      auto magnitude = fabs(centerDistance - (size / 2));
-      filter.set(x, y, magnitude);
+// Coarse summaries of an Image. Level l holds one Summary per 2^l x 2^l block
+// of cells, up to a single block covering everything; level 0 is the image
+// itself and is not stored. conv2d fills level 1 while its output rows are
+// still in cache, single cell edits only refresh the blocks above the cell,
+// and the higher levels together are a third of level 1.
+class Pyramid {
+public:
+  Pyramid(size_t width, size_t height) : width(width), height(height) {
+    size_t w = width;
+    size_t h = height;
+    while (w > 1 || h > 1) {
+      w = (w + 1) / 2;
+      h = (h + 1) / 2;
+      levels_.push_back({w, h, std::vector<Summary>(w * h)});
     }
   }
-  filter = normalize(filter);
+
+  struct Level {
+    size_t width;
+    size_t height;
+    std::vector<Summary> data;
+  };
+
+  size_t levels() const { return levels_.size() + 1; }
+  const Level &level(size_t l) const { return levels_[l - 1]; }
+
+  const Summary &get(size_t l, size_t x, size_t y) const {
+    return row(l, y)[x];
+  }
+
+  const Summary *row(size_t l, size_t y) const {
+    const auto &lvl = level(l);
+    return &lvl.data[y * lvl.width];
+  }
+
+  // Summary of the whole image.
+  const Summary &total() const {
+    static const Summary empty{0.0f, 0.0f, 0.0f};
+    return levels_.empty() ? empty : levels_.back().data.front();
+  }
+
+  // Refreshes the level 1 blocks built from image rows 2 * band and
+  // 2 * band + 1.
+  template <typename I> void reduceBand(const I &image, size_t band) {
+    if (levels_.empty())
+      return;
+    auto &lvl = levels_.front();
+    for (size_t x = 0; x < lvl.width; ++x) {
+      lvl.data[band * lvl.width + x] = image.summarize(2 * x, 2 * band, 2, 2);
+    }
+  }
+
+  // Rebuilds levels 2 and up from level 1.
+  void propagate() {
+    for (size_t l = 2; l < levels(); ++l) {
+      std::for_each(std::execution::par, boost::counting_iterator<size_t>(0),
+                    boost::counting_iterator<size_t>(level(l).height),
+                    [&](size_t y) {
+                      for (size_t x = 0; x < level(l).width; ++x) {
+                        combine(l, x, y);
+                      }
+                    });
+    }
+  }
+
+  template <typename I> void rebuild(const I &image) {
+    if (levels_.empty())
+      return;
+    std::for_each(std::execution::par, boost::counting_iterator<size_t>(0),
+                  boost::counting_iterator<size_t>(levels_.front().height),
+                  [&](size_t band) { reduceBand(image, band); });
+    propagate();
+  }
+
+  // Refreshes the blocks containing cell (x, y) after it was changed.
+  template <typename I> void update(const I &image, size_t x, size_t y) {
+    if (levels_.empty())
+      return;
+    x /= 2;
+    y /= 2;
+    levels_.front().data[y * levels_.front().width + x] =
+        image.summarize(2 * x, 2 * y, 2, 2);
+    for (size_t l = 2; l < levels(); ++l) {
+      x /= 2;
+      y /= 2;
+      combine(l, x, y);
+    }
+  }
+
+  // Heap memory held by the stored levels.
+  size_t bytes() const {
+    size_t total = 0;
+    for (const auto &lvl : levels_) {
+      total += lvl.data.capacity() * sizeof(Summary);
+    }
+    return total;
+  }
+
+  const size_t width;
+  const size_t height;
+
+private:
+  std::vector<Level> levels_;
+
+  // Number of cells along an axis of the given extent covered by block b of
+  // level l.
+  static size_t cells(size_t l, size_t b, size_t extent) {
+    return std::min((b + 1) << l, extent) - (b << l);
+  }
+
+  void combine(size_t l, size_t x, size_t y) {
+    const auto &below = level(l - 1);
+    Summary s = below.data[2 * y * below.width + 2 * x];
+    s.mean = 0.0f;
+    for (size_t j = 2 * y; j < std::min(2 * y + 2, below.height); ++j) {
+      for (size_t i = 2 * x; i < std::min(2 * x + 2, below.width); ++i) {
+        const auto &child = below.data[j * below.width + i];
+        s.min = std::min(s.min, child.min);
+        s.max = std::max(s.max, child.max);
+        s.mean +=
+            child.mean * cells(l - 1, i, width) * cells(l - 1, j, height);
+      }
+    }
+    s.mean /= cells(l, x, width) * cells(l, y, height);
+    levels_[l - 1].data[y * level(l).width + x] = s;
+  }
+};
+
+template <typename T, typename Layout>
+template <typename S>
+Image<T, Layout> Image<T, Layout>::generate(size_t width, size_t height,
+                                            size_t halo, S &&strip,
+                                            Pyramid *pyramid,
+                                            const FrameTarget *frame,
+                                            FieldStats *stats,
+                                            const ConvPlan &plan) {
+  Image result(width, height, halo);
+  const size_t stripRows = std::max<size_t>(2, (plan.stripRows + 1) / 2 * 2);
+  const size_t strips = (height + stripRows - 1) / stripRows;
+  // Each strip reduces into its own slot, merged once the pass is done.
+  std::vector<FieldStats> partials(stats ? strips : 0);
+  // Work on strips of whole row pairs so each pair can be summarized while
+  // it is hot.
+  const auto fill = [&](size_t index) {
+    const trace::Scope scope("strip");
+    const size_t y0 = index * stripRows;
+    const size_t y1 = std::min(y0 + stripRows, height);
+    const auto value = strip(y0, y1);
+    FieldStats partial;
+    for (size_t y = y0; y < y1; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        const Compute cell = value(x, y);
+        result.set(x, y, cell);
+        partial.add(cell);
+        if (frame && x - frame->originX < frame->width &&
+            y - frame->originY < frame->height) {
+          frame->pixels[(y - frame->originY) * frame->stride + x -
+                        frame->originX] = colormap(cell);
+        }
+      }
+    }
+    if (stats)
+      partials[index] = partial;
+    for (size_t band = y0 / 2; pyramid && band < (y1 + 1) / 2; ++band) {
+      pyramid->reduceBand(result, band);
+    }
+  };
+  const auto run = [&] {
+    std::for_each(std::execution::par, boost::counting_iterator<size_t>(0),
+                  boost::counting_iterator<size_t>(strips), fill);
+  };
+  if (plan.threads)
+    tbb::task_arena(plan.threads).execute(run);
+  else
+    run();
+  if (pyramid)
+    pyramid->propagate();
+  if (stats) {
+    *stats = FieldStats();
+    for (const auto &partial : partials) {
+      stats->merge(partial);
+    }
+  }
+  return result;
+}
+
+// A filter prepared for a plan as conv2d applies it. strip(y0, y1) prepares
+// rows [y0, y1) of the output and returns the function giving the value of
+// each of their cells, for generate to run with stripPlan. The input and
+// filter are referenced, so they have to outlive the convolution and the
+// functions of its strips.
+template <typename T, typename Layout> class Image<T, Layout>::Convolution {
+public:
+  Convolution(const Image &input, const Filter &filter, const ConvPlan &plan)
+      : stripPlan(plan), input(input), filter(filter), fw(filter.width),
+        fh(filter.height) {
+    padded = input.halo >= std::max(filter.width, filter.height) / 2;
+    separable = padded && plan.method == ConvPlan::Method::Separable &&
+                factorize(filter, columns, rows);
+    // Direct plans fold filters with the symmetries of a square. Below 7 x 7
+    // filling the folded rows costs more than the multiplies it saves.
+    folded = padded && plan.method == ConvPlan::Method::Direct &&
+             filter.width >= 7 && fold(filter, weights);
+    sparse = padded && plan.method == ConvPlan::Method::Sparse;
+    if (sparse)
+      taps = sparsify(filter, plan.threshold);
+    tile = plan.tile ? plan.tile : filter.width == 3 ? 4 : 2;
+    winograd = padded && plan.method == ConvPlan::Method::Winograd &&
+               filter.width == filter.height && filter.width % 2 == 1 &&
+               tile + filter.width <= 9;
+    // Winograd strips start on a tile row.
+    inputs = winograd ? tile + filter.width - 1 : 0;
+    if (winograd) {
+      const auto a = winograd::minimal(tile, filter.width);
+      const size_t k = filter.width;
+      std::vector<double> half(inputs * k, 0.0);
+      for (size_t j = 0; j < inputs; ++j) {
+        for (size_t y = 0; y < k; ++y) {
+          for (size_t x = 0; x < k; ++x) {
+            half[j * k + y] += a.g[j * k + x] * filter.get(x, y);
+          }
+        }
+      }
+      spectrum.assign(inputs * inputs, 0);
+      for (size_t j = 0; j < inputs; ++j) {
+        for (size_t i = 0; i < inputs; ++i) {
+          double sum = 0.0;
+          for (size_t y = 0; y < k; ++y) {
+            sum += a.g[i * k + y] * half[j * k + y];
+          }
+          spectrum[i * inputs + j] = sum;
+        }
+      }
+      for (size_t j = 0; j < inputs; ++j) {
+        for (size_t l = 0; l < inputs; ++l) {
+          if (a.bt[j * inputs + l] != 0.0)
+            bt.emplace_back(j, l, a.bt[j * inputs + l]);
+        }
+      }
+      for (size_t i = 0; i < tile; ++i) {
+        for (size_t j = 0; j < inputs; ++j) {
+          if (a.at[i * inputs + j] != 0.0)
+            at.emplace_back(i, j, a.at[i * inputs + j]);
+        }
+      }
+      stripPlan.stripRows =
+          (std::max(plan.stripRows, tile) + tile - 1) / tile * tile;
+    }
+    // Layouts without contiguous rows read a strip's cells from a gathered
+    // row-major window. Strips of at least a filter's height of rows keep the
+    // rows gathered for the filter's reach from outnumbering those output.
+    gathered = !Layout::contiguousRows && padded && !winograd;
+    windowStride = input.width + fw - 1;
+    if (gathered)
+      stripPlan.stripRows = std::max<size_t>(plan.stripRows, fh);
+  }
+
+  auto strip(size_t y0, size_t y1) const {
+    std::vector<T> window =
+        gathered ? gatherRows(input, y0, y1, fw, fh) : std::vector<T>();
+    const auto cell = [&](long x, long y) -> Compute {
+      if constexpr (!Layout::contiguousRows) {
+        if (gathered)
+          return window[(y - long(y0) + fh / 2) * windowStride + x + fw / 2];
+      }
+      return input.storage()[input.offset(x, y)];
+    };
+    // Row pass of a separable filter over the strip and the rows its
+    // column pass reaches.
+    std::vector<Compute> rowPass(separable ? (y1 - y0 + fh - 1) * input.width
+                                           : 0);
+    for (long j = 0; separable && j < long(y1 - y0) + fh - 1; ++j) {
+      const long y = long(y0) + j - fh / 2;
+      for (size_t x = 0; x < input.width; ++x) {
+        Compute sum = 0;
+        for (long fx = 0; fx < fw; ++fx) {
+          sum += rows[fx] * cell(long(x) + fx - fw / 2, y);
+        }
+        rowPass[j * input.width + x] = sum;
+      }
+    }
+    // Folded filters pair each row above the cell with the one mirrored
+    // below it: vertical[((y - y0) * n + dy) * span + r + i] holds the sum
+    // of the cells dy rows above and below (x, y) for x = i, and
+    // transposed[((y - y0) * span + r + i) * n + dy] the same value.
+    const long r = fw / 2;
+    const long n = r + 1;
+    const long span = input.width + 2 * r;
+    const size_t foldSize = folded ? (y1 - y0) * n * span : 0;
+    std::vector<Compute> vertical(foldSize);
+    std::vector<Compute> transposed(foldSize);
+    for (long j = 0; folded && j < long(y1 - y0); ++j) {
+      const long y = long(y0) + j;
+      for (long dy = 0; dy <= r; ++dy) {
+        for (long i = 0; i < span; ++i) {
+          const long x = i - r;
+          Compute sum = cell(x, y + dy);
+          if (dy)
+            sum += cell(x, y - dy);
+          vertical[(j * n + dy) * span + i] = sum;
+          transposed[(j * span + i) * n + dy] = sum;
+        }
+      }
+    }
+    // Winograd tiles of the strip, tiles[(y - y0) * outWidth + x]. The input
+    // rows a tile row reads are transformed along columns once, shared by
+    // all tiles, then each tile along its row. The loops over tiles are
+    // innermost so they vectorize.
+    const size_t tilesX = winograd ? (input.width + tile - 1) / tile : 0;
+    const size_t outWidth = tilesX * tile;
+    const size_t tileRows = (y1 - y0 + tile - 1) / tile;
+    std::vector<Compute> tiles(winograd ? tileRows * tile * outWidth : 0);
+    if (winograd) {
+      const long pad = fw / 2;
+      const long columns = outWidth + fw - 1;
+      std::vector<Compute> cells(inputs * columns);
+      std::vector<Compute> down(inputs * columns);
+      std::vector<Compute> product(inputs * inputs * tilesX);
+      std::vector<Compute> across(inputs * tile * tilesX);
+      for (size_t row = 0; row < tileRows; ++row) {
+        // The tiles of the last column and row may reach past the halo.
+        const long top = long(y0 + row * tile) - pad;
+        for (size_t k = 0; k < inputs; ++k) {
+          const long y = top + long(k);
+          for (long c = 0; c < columns; ++c) {
+            const long x = c - pad;
+            cells[k * columns + c] =
+                x < long(input.width + input.halo) &&
+                        y < long(input.height + input.halo)
+                    ? Compute(input.storage()[input.offset(x, y)])
+                    : Compute(0);
+          }
+        }
+        std::fill(down.begin(), down.end(), 0);
+        for (const auto &[j, l, c] : bt) {
+          for (long i = 0; i < columns; ++i) {
+            down[j * columns + i] += c * cells[l * columns + i];
+          }
+        }
+        std::fill(product.begin(), product.end(), 0);
+        for (size_t j = 0; j < inputs; ++j) {
+          for (const auto &[i, l, c] : bt) {
+            Compute *v = &product[(j * inputs + i) * tilesX];
+            const Compute *d = &down[j * columns + l];
+            for (size_t t = 0; t < tilesX; ++t) {
+              v[t] += c * d[t * tile];
+            }
+          }
+        }
+        for (size_t e = 0; e < inputs * inputs; ++e) {
+          for (size_t t = 0; t < tilesX; ++t) {
+            product[e * tilesX + t] *= spectrum[e];
+          }
+        }
+        std::fill(across.begin(), across.end(), 0);
+        for (size_t j = 0; j < inputs; ++j) {
+          for (const auto &[a, i, c] : at) {
+            Compute *z = &across[(j * tile + a) * tilesX];
+            const Compute *v = &product[(j * inputs + i) * tilesX];
+            for (size_t t = 0; t < tilesX; ++t) {
+              z[t] += c * v[t];
+            }
+          }
+        }
+        for (const auto &[b, j, c] : at) {
+          for (size_t a = 0; a < tile; ++a) {
+            Compute *out = &tiles[(row * tile + b) * outWidth + a];
+            const Compute *z = &across[(j * tile + a) * tilesX];
+            for (size_t t = 0; t < tilesX; ++t) {
+              out[t * tile] += c * z[t];
+            }
+          }
+        }
+      }
+    }
+    return [&, y0, r, n, span, outWidth, rowPass = std::move(rowPass),
+            vertical = std::move(vertical), transposed = std::move(transposed),
+            tiles = std::move(tiles),
+            window = std::move(window)](size_t x, size_t y) {
+      if (winograd)
+        return tiles[(y - y0) * outWidth + x];
+      if (folded) {
+        // The eight taps (+-dx, +-dy) and (+-dy, +-dx) share a weight, and
+        // those with dx = dy or dy = 0 coincide in fours.
+        const Compute *rows = &vertical[(y - y0) * n * span + r + x];
+        const Compute *columns = &transposed[((y - y0) * span + r + x) * n];
+        Compute value = weights[0] * rows[0];
+        for (long dy = 0; dy <= r; ++dy) {
+          const Compute *row = rows + dy * span;
+          const Compute *right = columns + dy * n;
+          const Compute *left = columns - dy * n;
+          const Compute *w = &weights[dy * n];
+          Compute sum = 0;
+          if (dy == 0) {
+            for (long dx = 1; dx <= r; ++dx) {
+              sum += w[dx] * (row[dx] + row[-dx] + right[dx]);
+            }
+          } else {
+            for (long dx = dy + 1; dx <= r; ++dx) {
+              sum += w[dx] * (row[dx] + row[-dx] + right[dx] + left[dx]);
+            }
+            sum += w[dy] * (row[dy] + row[-dy]);
+          }
+          value += sum;
+        }
+        return value;
+      }
+      if (sparse) {
+        Compute value = 0;
+        for (const auto &run : taps.runs) {
+          const Compute *w = &taps.weights[run.first];
+          if constexpr (Layout::contiguousRows) {
+            const T *cells = input.row(y) + run.dy * long(input.stride) +
+                             long(x) + run.dx;
+            for (size_t i = 0; i < run.length; ++i) {
+              value += w[i] * cells[i];
+            }
+          } else {
+            const T *cells =
+                &window[(long(y - y0) + run.dy + fh / 2) * long(windowStride) +
+                        long(x) + run.dx + fw / 2];
+            for (size_t i = 0; i < run.length; ++i) {
+              value += w[i] * cells[i];
+            }
+          }
+        }
+        return value;
+      }
+      if (separable) {
+        const Compute *column = &rowPass[(y - y0) * input.width + x];
+        Compute value = 0;
+        for (long fy = 0; fy < fh; ++fy) {
+          value += columns[fy] * column[fy * input.width];
+        }
+        return value;
+      }
+      const Index pos(x, y);
+      if (!padded)
+        return getConvPixel(input, pos, filter);
+      if constexpr (Layout::contiguousRows)
+        return getPaddedConvPixel(input, pos, filter);
+      return getWindowConvPixel(&window[(y - y0) * windowStride + x],
+                                windowStride, filter);
+    };
+  }
+
+  ConvPlan stripPlan;
+
+private:
+  const Image &input;
+  const Filter &filter;
+  long fw;
+  long fh;
+  bool padded;
+  bool separable;
+  bool folded;
+  bool sparse;
+  bool winograd;
+  bool gathered;
+  std::vector<Compute> columns;
+  std::vector<Compute> rows;
+  std::vector<Compute> weights;
+  SparseTaps<Compute> taps;
+  size_t tile;
+  size_t inputs;
+  size_t windowStride;
+  // The Winograd filter transformed once, and the matrices with their
+  // zeros dropped.
+  std::vector<Compute> spectrum;
+  std::vector<std::tuple<size_t, size_t, Compute>> bt;
+  std::vector<std::tuple<size_t, size_t, Compute>> at;
+};
+
+template <typename T, typename Layout>
+Image<T, Layout> Image<T, Layout>::conv2d(const Image &input,
+                                          const Filter &filter,
+                                          Pyramid *pyramid,
+                                          const FrameTarget *frame,
+                                          FieldStats *stats,
+                                          const ConvPlan &plan) {
+  const Convolution convolution(input, filter, plan);
+  return generate(
+      input.width, input.height, input.halo,
+      [&](size_t y0, size_t y1) { return convolution.strip(y0, y1); },
+      pyramid, frame, stats, convolution.stripPlan);
+}
+
+template <typename T, typename Layout>
+typename Image<T, Layout>::Stack
+Image<T, Layout>::stack(const std::vector<Filter> &filters) {
+  size_t uw = 0;
+  size_t uh = 0;
+  for (const auto &filter : filters) {
+    uw = std::max(uw, filter.width);
+    uh = std::max(uh, filter.height);
+  }
+  const auto tap = [](const Filter &filter, long dx, long dy) {
+    const long fx = dx + long(filter.width / 2);
+    const long fy = dy + long(filter.height / 2);
+    return fx >= 0 && fx < long(filter.width) && fy >= 0 &&
+                   fy < long(filter.height)
+               ? filter.get(fx, fy)
+               : Compute(0);
+  };
+  Stack result;
+  for (long y = 0; y < long(uh); ++y) {
+    for (long x = 0; x < long(uw); ++x) {
+      const long dx = x - long(uw / 2);
+      const long dy = y - long(uh / 2);
+      bool used = false;
+      for (const auto &filter : filters) {
+        used |= tap(filter, dx, dy) != 0;
+      }
+      if (used)
+        result.offsets.emplace_back(dx, dy);
+    }
+  }
+  const size_t m = filters.size();
+  const size_t k = result.offsets.size();
+  std::vector<Compute> a(m * k);
+  for (size_t i = 0; i < m; ++i) {
+    for (size_t p = 0; p < k; ++p) {
+      a[i * k + p] =
+          tap(filters[i], result.offsets[p].first, result.offsets[p].second);
+    }
+  }
+  const size_t panels = (m + gemm::MR - 1) / gemm::MR;
+  result.packed.resize(panels * k * gemm::MR);
+  for (size_t ip = 0; ip < panels; ++ip) {
+    gemm::packA(a.data(), m, k, ip * gemm::MR,
+                &result.packed[ip * k * gemm::MR]);
+  }
+  result.filters = m;
+  result.reach = std::max(uw, uh) / 2;
+  return result;
+}
+
+template <typename T, typename Layout>
+void Image<T, Layout>::stackedRow(const Image &input, const Stack &stack,
+                                  size_t y, Compute *values,
+                                  gemm::Workspace<Compute> &work) {
+  const bool padded = input.halo >= stack.reach;
+  const long w = input.width;
+  const long h = input.height;
+  // Column j of B holds the cells under every tap for output (j, y).
+  const auto packB = [&](size_t p0, size_t p1, size_t j0, size_t j1,
+                         Compute *block) {
+    for (size_t jp = 0; j0 + jp * gemm::NR < j1; ++jp) {
+      const long x0 = long(j0 + jp * gemm::NR);
+      const size_t valid = std::min(gemm::NR, j1 - size_t(x0));
+      Compute *panel = block + jp * (p1 - p0) * gemm::NR;
+      for (size_t p = p0; p < p1; ++p) {
+        const auto [dx, dy] = stack.offsets[p];
+        Compute *out = panel + (p - p0) * gemm::NR;
+        if (!padded) {
+          const size_t wy = ((long(y) + dy) % h + h) % h;
+          for (size_t j = 0; j < valid; ++j) {
+            out[j] = input.get(((x0 + long(j) + dx) % w + w) % w, wy);
+          }
+        } else if constexpr (Layout::contiguousRows) {
+          const T *cells = input.row(y) + dy * long(input.stride) + x0 + dx;
+          for (size_t j = 0; j < valid; ++j) {
+            out[j] = cells[j];
+          }
+        } else {
+          const T *cells = input.storage() + input.yOffset(long(y) + dy);
+          for (size_t j = 0; j < valid; ++j) {
+            out[j] = cells[input.xOffset(x0 + long(j) + dx)];
+          }
+        }
+        std::fill(out + valid, out + gemm::NR, Compute(0));
+      }
+    }
+  };
+  gemm::multiply(stack.filters, input.width, stack.offsets.size(),
+                 stack.packed, packB, values, input.width, work);
+}
+
+template <typename T, typename Layout>
+std::vector<Image<typename Image<T, Layout>::Compute>>
+Image<T, Layout>::conv2d(const Image &input, const std::vector<Filter> &filters,
+                         const ConvPlan &plan) {
+  const Stack stacked = stack(filters);
+  const size_t m = filters.size();
+  std::vector<Image<Compute>> results;
+  for (size_t i = 0; i < m; ++i) {
+    results.emplace_back(input.width, input.height, input.halo);
+  }
+  const size_t stripRows = std::max<size_t>(1, plan.stripRows);
+  const auto fill = [&](size_t index) {
+    thread_local gemm::Workspace<Compute> work;
+    std::vector<Compute> values(m * input.width);
+    for (size_t y = index * stripRows;
+         y < std::min((index + 1) * stripRows, input.height); ++y) {
+      stackedRow(input, stacked, y, values.data(), work);
+      for (size_t i = 0; i < m; ++i) {
+        for (size_t x = 0; x < input.width; ++x) {
+          results[i].set(x, y, values[i * input.width + x]);
+        }
+      }
+    }
+  };
+  const auto run = [&] {
+    std::for_each(std::execution::par, boost::counting_iterator<size_t>(0),
+                  boost::counting_iterator<size_t>(
+                      (input.height + stripRows - 1) / stripRows),
+                  fill);
+  };
+  if (plan.threads)
+    tbb::task_arena(plan.threads).execute(run);
+  else
+    run();
+  return results;
+}
+
+template <typename T, typename Layout>
+template <typename F>
+Image<T, Layout> Image<T, Layout>::fusedConv2d(
+    const Image &input, const std::vector<Filter> &filters, F &&combine,
+    Pyramid *pyramid, const FrameTarget *frame, FieldStats *stats,
+    const ConvPlan &plan) {
+  const Stack stacked = stack(filters);
+  const size_t m = filters.size();
+  const size_t w = input.width;
+  const auto strip = [&](size_t y0, size_t y1) {
+    // The values of each cell side by side, cells[((y - y0) * w + x) * m].
+    std::vector<Compute> cells((y1 - y0) * w * m);
+    thread_local gemm::Workspace<Compute> work;
+    std::vector<Compute> values(m * w);
+    for (size_t y = y0; y < y1; ++y) {
+      stackedRow(input, stacked, y, values.data(), work);
+      for (size_t i = 0; i < m; ++i) {
+        for (size_t x = 0; x < w; ++x) {
+          cells[((y - y0) * w + x) * m + i] = values[i * w + x];
+        }
+      }
+    }
+    return [&, y0, cells = std::move(cells)](size_t x, size_t y) {
+      return Compute(combine(&cells[((y - y0) * w + x) * m]));
+    };
+  };
+  return generate(input.width, input.height, input.halo, strip, pyramid,
+                  frame, stats, plan);
+}
+
+template <typename T, typename Layout>
+template <typename F>
+Image<T, Layout> Image<T, Layout>::combinedConv2d(
+    const Image &input, const std::vector<Filter> &filters, F &&combine,
+    Pyramid *pyramid, const FrameTarget *frame, FieldStats *stats,
+    const ConvPlan &plan) {
+  // Strips have to suit every filter: as tall as the tallest a filter asks
+  // for, and whole Winograd tiles of 2 or 4 rows.
+  std::vector<Convolution> convolutions;
+  convolutions.reserve(filters.size());
+  ConvPlan stripPlan = plan;
+  for (const auto &filter : filters) {
+    convolutions.emplace_back(input, filter, plan);
+    stripPlan.stripRows = std::max(stripPlan.stripRows,
+                                   convolutions.back().stripPlan.stripRows);
+  }
+  if (plan.method == ConvPlan::Method::Winograd)
+    stripPlan.stripRows = (stripPlan.stripRows + 3) / 4 * 4;
+  const auto strip = [&](size_t y0, size_t y1) {
+    using Cells = decltype(convolutions.front().strip(y0, y1));
+    std::vector<Cells> cells;
+    cells.reserve(convolutions.size());
+    for (const auto &convolution : convolutions) {
+      cells.push_back(convolution.strip(y0, y1));
+    }
+    return [&combine, cells = std::move(cells)](size_t x, size_t y) {
+      struct Values {
+        const std::vector<Cells> &cells;
+        size_t x;
+        size_t y;
+        Compute operator[](size_t i) const { return cells[i](x, y); }
+      };
+      return Compute(combine(Values{cells, x, y}));
+    };
+  };
+  return generate(input.width, input.height, input.halo, strip, pyramid,
+                  frame, stats, stripPlan);
+}
+
+template <typename T, typename Layout>
+template <typename F>
+Image<T, Layout> Image<T, Layout>::separateConv2d(
+    const Image &input, const std::vector<Filter> &filters, F &&combine,
+    std::vector<Compute> &passes, Pyramid *pyramid, const FrameTarget *frame,
+    FieldStats *stats, const ConvPlan &plan) {
+  // passes[i * cells + y * width + x] is the value of filter i for (x, y).
+  const size_t w = input.width;
+  const size_t cells = w * input.height;
+  passes.resize(filters.size() * cells);
+  for (size_t i = 0; i < filters.size(); ++i) {
+    const Convolution convolution(input, filters[i], plan);
+    const size_t stripRows = std::max<size_t>(1, convolution.stripPlan.stripRows);
+    const size_t strips = (input.height + stripRows - 1) / stripRows;
+    Compute *out = &passes[i * cells];
+    const auto fill = [&](size_t index) {
+      const trace::Scope scope("strip");
+      const size_t y0 = index * stripRows;
+      const size_t y1 = std::min(y0 + stripRows, input.height);
+      const auto value = convolution.strip(y0, y1);
+      for (size_t y = y0; y < y1; ++y) {
+        for (size_t x = 0; x < w; ++x) {
+          out[y * w + x] = value(x, y);
+        }
+      }
+    };
+    const auto run = [&] {
+      std::for_each(std::execution::par, boost::counting_iterator<size_t>(0),
+                    boost::counting_iterator<size_t>(strips), fill);
+    };
+    if (plan.threads)
+      tbb::task_arena(plan.threads).execute(run);
+    else
+      run();
+  }
+  struct Values {
+    const Compute *cell;
+    size_t cells;
+    Compute operator[](size_t i) const { return cell[i * cells]; }
+  };
+  const auto strip = [&](size_t, size_t) {
+    return [&](size_t x, size_t y) {
+      return Compute(combine(Values{&passes[y * w + x], cells}));
+    };
+  };
+  return generate(input.width, input.height, input.halo, strip, pyramid,
+                  frame, stats, plan);
+}
+
+template <typename T, typename Layout>
+Image<T, Layout> Image<T, Layout>::upsample(const Image<Compute> &coarse,
+                                            size_t factor, size_t width,
+                                            size_t height, size_t halo,
+                                            Pyramid *pyramid,
+                                            const FrameTarget *frame,
+                                            FieldStats *stats,
+                                            const ConvPlan &plan) {
+  // Coarse cell X is centered on fine coordinate (X + 1/2) * factor - 1/2.
+  const auto coordinate = [factor](size_t i, long &cell, Compute &weight) {
+    const Compute u = (i + Compute(0.5)) / factor - Compute(0.5);
+    cell = long(std::floor(u));
+    weight = u - cell;
+  };
+  const auto strip = [&](size_t, size_t) {
+    return [&](size_t x, size_t y) {
+      long cx;
+      long cy;
+      Compute ax;
+      Compute ay;
+      coordinate(x, cx, ax);
+      coordinate(y, cy, ay);
+      const Compute *cells = coarse.storage();
+      const auto at = [&](long i, long j) {
+        return cells[coarse.offset(i, j)];
+      };
+      return (1 - ay) * ((1 - ax) * at(cx, cy) + ax * at(cx + 1, cy)) +
+             ay * ((1 - ax) * at(cx, cy + 1) + ax * at(cx + 1, cy + 1));
+    };
+  };
+  return generate(width, height, halo, strip, pyramid, frame, stats, plan);
+}
+
+template <typename T, typename Layout>
+Image<T, Layout>
+Image<T, Layout>::boxSums(const Image &input,
+                         const std::vector<WeightedBox> &boxes,
+                         std::vector<double> &table, Pyramid *pyramid,
+                         const FrameTarget *frame, FieldStats *stats,
+                         const ConvPlan &plan) {
+  // table[(y + 1) * columns + x + 1] sums the padded cells up to (x, y).
+  // Row 0 and column 0 stay zero, every other entry is overwritten.
+  const long pad = input.halo;
+  for (const auto &box : boxes) {
+    assert(box.x0 >= -pad && box.y0 >= -pad && box.x1 <= pad &&
+           box.y1 <= pad);
+  }
+  const size_t columns = input.width + 2 * pad + 1;
+  const size_t rowCount = input.height + 2 * pad + 1;
+  table.resize(columns * rowCount);
+  std::fill_n(table.begin(), columns, 0.0);
+  // Prefix sums along rows, then down blocks of columns, both in parallel.
+  std::for_each(std::execution::par, boost::counting_iterator<size_t>(1),
+                boost::counting_iterator<size_t>(rowCount), [&](size_t j) {
+                  double sum = 0.0;
+                  table[j * columns] = 0.0;
+                  for (size_t i = 1; i < columns; ++i) {
+                    sum += input.storage()[input.offset(long(i) - 1 - pad,
+                                                        long(j) - 1 - pad)];
+                    table[j * columns + i] = sum;
+                  }
+                });
+  constexpr size_t block = 64;
+  std::for_each(std::execution::par, boost::counting_iterator<size_t>(0),
+                boost::counting_iterator<size_t>((columns + block - 1) / block),
+                [&](size_t b) {
+                  const size_t i0 = std::max<size_t>(1, b * block);
+                  const size_t i1 = std::min(columns, (b + 1) * block);
+                  for (size_t j = 2; j < rowCount; ++j) {
+                    double *row = &table[j * columns];
+                    const double *above = row - columns;
+                    for (size_t i = i0; i < i1; ++i) {
+                      row[i] += above[i];
+                    }
+                  }
+                });
+  const auto strip = [&](size_t, size_t) {
+    return [&](size_t x, size_t y) {
+      // Corner offsets of the table relative to the cell.
+      const double *origin = &table[(y + pad) * columns + x + pad];
+      double value = 0.0;
+      for (const auto &box : boxes) {
+        const long top = box.y0 * long(columns);
+        const long bottom = (box.y1 + 1) * long(columns);
+        value += box.weight * (origin[bottom + box.x1 + 1] -
+                               origin[bottom + box.x0] -
+                               origin[top + box.x1 + 1] + origin[top + box.x0]);
+      }
+      return Compute(value);
+    };
+  };
+  return generate(input.width, input.height, input.halo, strip, pyramid,
+                  frame, stats, plan);
+}
+
+namespace bench {
+// Median wall time of a call to f in milliseconds, after one warm up call.
+template <typename F> double milliseconds(F &&f, int runs = 5) {
+  f();
+  std::vector<double> times;
+  for (int i = 0; i < runs; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const auto end = std::chrono::steady_clock::now();
+    times.push_back(std::chrono::duration<double, std::milli>(end - start)
+                        .count());
+  }
+  std::nth_element(times.begin(), times.begin() + runs / 2, times.end());
+  return times[runs / 2];
+}
+} // namespace bench
+
+namespace tuning {
+// Value of a field of the first CPU in /proc/cpuinfo.
+std::string cpuInfo(const std::string &field) {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.rfind(field, 0) == 0)
+      return line.substr(line.find(':') + 2);
+  }
+  return "unknown";
+}
+
+// Model name of the first CPU, which keys autotuning results.
+std::string cpuModel() { return cpuInfo("model name"); }
+// Vendor of the first CPU, such as GenuineIntel or AuthenticAMD.
+std::string cpuVendor() { return cpuInfo("vendor_id"); }
+
+// FNV-1a hash of a filter's size and taps.
+template <typename F> uint64_t digest(const F &filter) {
+  uint64_t hash = 14695981039346656037ull;
+  const auto mix = [&hash](const void *data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ static_cast<const unsigned char *>(data)[i]) *
+             1099511628211ull;
+    }
+  };
+  mix(&filter.width, sizeof(filter.width));
+  mix(&filter.height, sizeof(filter.height));
+  for (size_t y = 0; y < filter.height; ++y) {
+    for (size_t x = 0; x < filter.width; ++x) {
+      const auto tap = filter.get(x, y);
+      mix(&tap, sizeof(tap));
+    }
+  }
+  return hash;
+}
+} // namespace tuning
+
+namespace fourier {
+// Xlib defines Complex as a macro.
+using Coefficient = std::complex<double>;
+
+// Discrete Fourier transform of a fixed length: radix 2 when the length is a
+// power of two, otherwise Bluestein's algorithm on top of a radix 2
+// transform of at least twice the length.
+class Transform {
+public:
+  explicit Transform(size_t n) : n(n), m(1) {
+    while (m < (isPowerOfTwo(n) ? n : 2 * n - 1)) {
+      m *= 2;
+    }
+    for (size_t k = 0; k < m / 2; ++k) {
+      twiddles_.push_back(std::polar(1.0, -2 * M_PI * k / m));
+    }
+    if (isPowerOfTwo(n))
+      return;
+    // k^2 is reduced mod 2n to keep the angles accurate.
+    for (size_t k = 0; k < n; ++k) {
+      chirp_.push_back(std::polar(1.0, -M_PI * double(k * k % (2 * n)) / n));
+    }
+    chirpSpectrum_.assign(m, 0.0);
+    for (size_t k = 0; k < n; ++k) {
+      chirpSpectrum_[k] = std::conj(chirp_[k]);
+      if (k)
+        chirpSpectrum_[m - k] = std::conj(chirp_[k]);
+    }
+    radix2(chirpSpectrum_.data());
+  }
+
+  // Transforms the n values data[0], data[stride], ... in place. The inverse
+  // is scaled by 1 / n.
+  void operator()(Coefficient *data, size_t stride, bool inverse) const {
+    std::vector<Coefficient> work(m);
+    for (size_t k = 0; k < n; ++k) {
+      work[k] = inverse ? std::conj(data[k * stride]) : data[k * stride];
+    }
+    if (isPowerOfTwo(n)) {
+      radix2(work.data());
+    } else {
+      for (size_t k = 0; k < n; ++k) {
+        work[k] *= chirp_[k];
+      }
+      std::fill(work.begin() + n, work.end(), 0.0);
+      radix2(work.data());
+      for (size_t k = 0; k < m; ++k) {
+        work[k] = std::conj(work[k] * chirpSpectrum_[k]);
+      }
+      radix2(work.data());
+      for (size_t k = 0; k < n; ++k) {
+        work[k] = std::conj(work[k]) / double(m) * chirp_[k];
+      }
+    }
+    for (size_t k = 0; k < n; ++k) {
+      data[k * stride] = inverse ? std::conj(work[k]) / double(n) : work[k];
+    }
+  }
+
+  const size_t n;
+
+private:
+  size_t m;
+  std::vector<Coefficient> twiddles_;
+  std::vector<Coefficient> chirp_;
+  std::vector<Coefficient> chirpSpectrum_;
+
+  static bool isPowerOfTwo(size_t n) { return (n & (n - 1)) == 0; }
+
+  // Forward transform of m values.
+  void radix2(Coefficient *data) const {
+    for (size_t i = 1, j = 0; i < m; ++i) {
+      size_t bit = m >> 1;
+      for (; j & bit; bit >>= 1) {
+        j ^= bit;
+      }
+      j |= bit;
+      if (i < j)
+        std::swap(data[i], data[j]);
+    }
+    for (size_t len = 2; len <= m; len *= 2) {
+      const size_t step = m / len;
+      for (size_t i = 0; i < m; i += len) {
+        for (size_t k = 0; k < len / 2; ++k) {
+          const Coefficient odd = data[i + k + len / 2] * twiddles_[k * step];
+          data[i + k + len / 2] = data[i + k] - odd;
+          data[i + k] += odd;
+        }
+      }
+    }
+  }
+};
+
+// Transforms a row-major width x height grid in place, rows then columns.
+void transform2d(std::vector<Coefficient> &data, size_t width, size_t height,
+                 bool inverse) {
+  const Transform rows(width);
+  const Transform columns(height);
+  std::for_each(std::execution::par, boost::counting_iterator<size_t>(0),
+                boost::counting_iterator<size_t>(height),
+                [&](size_t y) { rows(&data[y * width], 1, inverse); });
+  std::for_each(std::execution::par, boost::counting_iterator<size_t>(0),
+                boost::counting_iterator<size_t>(width),
+                [&](size_t x) { columns(&data[x], width, inverse); });
+}
+} // namespace fourier
+
+namespace filters {
+// Filter for a grid coarsened by factor, see Image::downsample. Each tap
+// moves to the coarse tap whose block, centered on the coarse cell, contains
+// its offset. With an even factor the offsets on a block edge are split
+// between the two blocks, which keeps the filter symmetric.
+template <typename F> F downsample(const F &filter, size_t factor) {
+  const long f = factor;
+  // Coarse taps receiving the fine tap at offset d along one axis, with
+  // their shares.
+  const auto targets = [f](long d) {
+    const long e = d + f / 2;
+    const long cell = e >= 0 ? e / f : -((-e + f - 1) / f);
+    if (f % 2 == 0 && e == cell * f)
+      return std::vector<std::pair<long, float>>{{cell - 1, 0.5f},
+                                                 {cell, 0.5f}};
+    return std::vector<std::pair<long, float>>{{cell, 1.0f}};
+  };
+  const long rx = filter.width / 2;
+  const long ry = filter.height / 2;
+  const long crx = (rx + f / 2) / f;
+  const long cry = (ry + f / 2) / f;
+  F coarse(2 * crx + 1, 2 * cry + 1);
+  for (long fy = 0; fy < long(filter.height); ++fy) {
+    for (long fx = 0; fx < long(filter.width); ++fx) {
+      for (const auto &[cy, wy] : targets(fy - ry)) {
+        for (const auto &[cx, wx] : targets(fx - rx)) {
+          coarse.add(cx + crx, cy + cry, wx * wy * filter.get(fx, fy));
+        }
+      }
+    }
+  }
+  return coarse;
+}
+
+// A filter approximated by nested discs of constant weight. Each disc is a
+// staircase of steps rectangles, clipped to the filter, and becomes steps
+// positive and steps - 1 negative boxes by inclusion-exclusion.
+struct Shells {
+  std::vector<WeightedBox> boxes;
+  // Relative L2 and L1 distance of the approximation from the filter. The
+  // L1 one bounds the error of a step relative to the field.
+  double error = 0.0;
+  double l1Error = 0.0;
+};
+
+// Fits up to shells discs of the given number of steps to the filter,
+// choosing their radii to minimize the squared error.
+template <typename F> Shells fitShells(const F &filter, size_t shells,
+                                       size_t steps) {
+  steps = std::max<size_t>(1, steps);
+  const long x0 = -long(filter.width / 2);
+  const long y0 = -long(filter.height / 2);
+  const long x1 = x0 + long(filter.width) - 1;
+  const long y1 = y0 + long(filter.height) - 1;
+  // Half extents of the rectangles of the staircase disc of radius r,
+  // widest first.
+  const auto staircase = [&](long r) {
+    std::vector<std::pair<long, long>> halfSizes;
+    for (size_t i = 0; i < steps; ++i) {
+      const double angle = (i + 0.5) / steps * M_PI / 2;
+      halfSizes.push_back({std::lround(r * std::cos(angle)),
+                           std::lround(r * std::sin(angle))});
+    }
+    return halfSizes;
+  };
+  const auto inside = [](const std::vector<std::pair<long, long>> &stair,
+                         long dx, long dy) {
+    for (const auto &[w, h] : stair) {
+      if (std::labs(dx) <= w && std::labs(dy) <= h)
+        return true;
+    }
+    return false;
+  };
+
+  // Smallest staircase radius containing each tap, and the count, sum and
+  // sum of squares of the taps first covered at each radius.
+  std::vector<long> radius(filter.width * filter.height, -1);
+  std::vector<double> count;
+  std::vector<double> sum;
+  std::vector<double> squares;
+  for (long r = 0, left = radius.size(); left > 0; ++r) {
+    const auto stair = staircase(r);
+    count.push_back(0.0);
+    sum.push_back(0.0);
+    squares.push_back(0.0);
+    for (long dy = y0; dy <= y1; ++dy) {
+      for (long dx = x0; dx <= x1; ++dx) {
+        long &rTap = radius[(dy - y0) * filter.width + dx - x0];
+        if (rTap >= 0 || !inside(stair, dx, dy))
+          continue;
+        rTap = r;
+        const double tap = filter.get(dx - x0, dy - y0);
+        count.back() += 1.0;
+        sum.back() += tap;
+        squares.back() += tap * tap;
+        --left;
+      }
+    }
+  }
+
+  // Splits the radii into at most shells runs of constant weight by dynamic
+  // programming over prefix sums.
+  const size_t levels = count.size();
+  std::vector<double> c(levels + 1, 0.0), s(levels + 1, 0.0),
+      q(levels + 1, 0.0);
+  for (size_t i = 0; i < levels; ++i) {
+    c[i + 1] = c[i] + count[i];
+    s[i + 1] = s[i] + sum[i];
+    q[i + 1] = q[i] + squares[i];
+  }
+  const auto cost = [&](size_t a, size_t b) {
+    const double n = c[b] - c[a];
+    return n > 0.0 ? q[b] - q[a] - std::pow(s[b] - s[a], 2) / n : 0.0;
+  };
+  shells = std::max<size_t>(1, std::min(shells, levels));
+  const double infinity = std::numeric_limits<double>::infinity();
+  std::vector<std::vector<double>> best(
+      shells + 1, std::vector<double>(levels + 1, infinity));
+  std::vector<std::vector<size_t>> split(
+      shells + 1, std::vector<size_t>(levels + 1, 0));
+  best[0][0] = 0.0;
+  for (size_t k = 1; k <= shells; ++k) {
+    for (size_t b = 1; b <= levels; ++b) {
+      for (size_t a = k - 1; a < b; ++a) {
+        const double total = best[k - 1][a] + cost(a, b);
+        if (total < best[k][b]) {
+          best[k][b] = total;
+          split[k][b] = a;
+        }
+      }
+    }
+  }
+  std::vector<size_t> ends;
+  for (size_t k = shells, b = levels; k > 0; b = split[k][b], --k) {
+    ends.push_back(b);
+  }
+  std::reverse(ends.begin(), ends.end());
+
+  // Weight of each run of radii, and from the differences between runs the
+  // weight of each disc.
+  Shells result;
+  std::vector<double> level(levels, 0.0);
+  double outer = 0.0;
+  for (size_t k = ends.size(), b = levels; k-- > 0;) {
+    const size_t a = k > 0 ? ends[k - 1] : 0;
+    const double n = c[b] - c[a];
+    const double weight = n > 0.0 ? (s[b] - s[a]) / n : outer;
+    std::fill(level.begin() + a, level.begin() + b, weight);
+    const auto stair = staircase(long(b) - 1);
+    const double discWeight = weight - outer;
+    const auto box = [&](long w, long h, double sign) {
+      result.boxes.push_back({std::max(-w, x0), std::max(-h, y0),
+                              std::min(w, x1), std::min(h, y1),
+                              sign * discWeight});
+    };
+    for (size_t i = 0; i < stair.size(); ++i) {
+      box(stair[i].first, stair[i].second, 1.0);
+      if (i + 1 < stair.size())
+        box(stair[i + 1].first, stair[i].second, -1.0);
+    }
+    outer = weight;
+    b = a;
+  }
+  // Boxes shared by neighbouring steps or discs are summed once.
+  std::map<std::tuple<long, long, long, long>, double> merged;
+  for (const auto &box : result.boxes) {
+    merged[{box.x0, box.y0, box.x1, box.y1}] += box.weight;
+  }
+  result.boxes.clear();
+  for (const auto &[corners, weight] : merged) {
+    if (weight != 0.0)
+      result.boxes.push_back({std::get<0>(corners), std::get<1>(corners),
+                              std::get<2>(corners), std::get<3>(corners),
+                              weight});
+  }
+
+  double error = 0.0;
+  double norm = 0.0;
+  double l1Error = 0.0;
+  double l1Norm = 0.0;
+  for (long dy = y0; dy <= y1; ++dy) {
+    for (long dx = x0; dx <= x1; ++dx) {
+      const double tap = filter.get(dx - x0, dy - y0);
+      const double fitted = level[radius[(dy - y0) * filter.width + dx - x0]];
+      error += std::pow(tap - fitted, 2);
+      norm += tap * tap;
+      l1Error += std::fabs(tap - fitted);
+      l1Norm += std::fabs(tap);
+    }
+  }
+  result.error = norm > 0.0 ? std::sqrt(error / norm) : 0.0;
+  result.l1Error = l1Norm > 0.0 ? l1Error / l1Norm : 0.0;
+  return result;
+}
+} // namespace filters
+
+template <typename T = float, typename Layout = RowMajor> class PixelBackEnd {
+public:
+  using Field = Image<T, Layout>;
+  using Filter = typename Field::Filter;
+  using Compute = typename Field::Compute;
+
+  // One term of a rule: the field convolved with kernel, passed through
+  // growth when it is set, and scaled by weight. A step sums the terms.
+  struct Term {
+    Filter kernel;
+    Compute weight = 1;
+    std::function<Compute(Compute)> growth = {};
+  };
+
+  // Everything that can change while the simulation runs. gain scales the
+  // whole rule, and mouseAdd and mouseMult are the edits of add and mult.
+  struct Parameters {
+    std::vector<Term> terms;
+    Compute gain = 1;
+    Compute mouseAdd = 100;
+    Compute mouseMult = 3;
+    ConvPlan plan;
+  };
+
+  // Parameters with what a step derives from them. Immutable once built,
+  // so a step holds on to one for its whole length while a new one is
+  // built and published from another thread.
+  struct Snapshot {
+    Parameters parameters;
+    // The linear terms merged into one filter over their union footprint.
+    Filter filter;
+    // Terms with growth, and the kernels of a step with growth: the merged
+    // filter when there are linear terms, then the kernel of every growing
+    // term.
+    std::vector<Term> growing;
+    std::vector<Filter> stacked;
+    // The filter as fitted for a Shells plan.
+    filters::Shells shells;
+    // The filter as downsampled for a Multiscale plan.
+    Filter coarse;
+  };
+
+  // The field gets a halo wide enough for filters up to convSize, larger
+  // filters fall back to periodic wrapping.
+  PixelBackEnd(size_t width, size_t height, size_t convSize)
+      : image(width, height, convSize / 2), pyramid(width, height) {
+    Parameters initial;
+    initial.terms.push_back({Filter(convSize, convSize)});
+    update(initial);
+  }
+  // Advances one generation, optionally drawing the new state into frame in
+  // the same pass.
+  void step(const FrameTarget *frame = nullptr) {
+    const trace::Scope scope("step");
+    adopt();
+    const Snapshot &now = *current_;
+    const ConvPlan &plan = now.parameters.plan;
+    // The sum of the old field, edits included.
+    const double before = stats_.sum;
+    if (!now.growing.empty()) {
+      const bool linear = now.stacked.size() > now.growing.size();
+      const auto combine = [&](const auto &values) {
+        Compute sum = linear ? values[0] : Compute(0);
+        for (size_t i = 0; i < now.growing.size(); ++i) {
+          sum += now.growing[i].weight *
+                 now.growing[i].growth(values[linear + i]);
+        }
+        return sum;
+      };
+      image.fillHalo(boundary);
+      if (plan.rule == ConvPlan::Rule::Fused)
+        image = Field::fusedConv2d(image, now.stacked, combine, &pyramid,
+                                   frame, &stats_, plan);
+      else if (plan.rule == ConvPlan::Rule::Separate)
+        image = Field::separateConv2d(image, now.stacked, combine, passes_,
+                                      &pyramid, frame, &stats_, plan);
+      else
+        image = Field::combinedConv2d(image, now.stacked, combine, &pyramid,
+                                      frame, &stats_, plan);
+    } else if (plan.method == ConvPlan::Method::Multiscale) {
+      image = multiscaleStep(frame);
+    } else if (!now.shells.boxes.empty()) {
+      image.fillHalo(boundary);
+      image = Field::boxSums(image, now.shells.boxes, integral_, &pyramid,
+                             frame, &stats_, plan);
+    } else {
+      image.fillHalo(boundary);
+      image = Field::conv2d(image, now.filter, &pyramid, frame, &stats_, plan);
+    }
+    stats_.drift = stats_.sum - before;
+  }
+
+  // Builds the snapshot of a set of parameters. Only reads the field's
+  // extents, so it may run on any thread while the simulation steps.
+  std::shared_ptr<const Snapshot> prepare(const Parameters &parameters) const {
+    const trace::Scope scope("prepare");
+    size_t w = 1;
+    size_t h = 1;
+    for (const auto &term : parameters.terms) {
+      if (!term.growth) {
+        w = std::max(w, term.kernel.width);
+        h = std::max(h, term.kernel.height);
+      }
+    }
+    Filter merged(w, h);
+    bool linear = false;
+    std::vector<Term> growing;
+    for (const auto &term : parameters.terms) {
+      if (term.growth) {
+        growing.push_back(term);
+        growing.back().weight *= parameters.gain;
+        continue;
+      }
+      linear = true;
+      const size_t x0 = w / 2 - term.kernel.width / 2;
+      const size_t y0 = h / 2 - term.kernel.height / 2;
+      for (size_t y = 0; y < term.kernel.height; ++y) {
+        for (size_t x = 0; x < term.kernel.width; ++x) {
+          merged.add(x0 + x, y0 + y,
+                     parameters.gain * term.weight * term.kernel.get(x, y));
+        }
+      }
+    }
+    std::vector<Filter> stacked;
+    if (!growing.empty()) {
+      if (linear)
+        stacked.push_back(merged);
+      for (const auto &term : growing) {
+        stacked.push_back(term.kernel);
+      }
+    }
+    const ConvPlan &plan = parameters.plan;
+    // Shells steps read the boxes from the halo, so a filter reaching past
+    // it is fitted no boxes and steps directly.
+    filters::Shells shells;
+    if (plan.method == ConvPlan::Method::Shells &&
+        image.halo >= std::max(merged.width, merged.height) / 2)
+      shells = filters::fitShells(merged, plan.shells, plan.steps);
+    Filter coarse = plan.method == ConvPlan::Method::Multiscale
+                        ? filters::downsample(merged, plan.factor)
+                        : Filter(1, 1);
+    return std::make_shared<const Snapshot>(
+        Snapshot{parameters, merged, growing, stacked, shells, coarse});
+  }
+  // Hands a snapshot from any thread to the next step, which adopts it
+  // before it starts. A later publish before that step replaces it.
+  void publish(std::shared_ptr<const Snapshot> next) {
+    std::atomic_store(&pending_, std::move(next));
+  }
+  // Replaces the parameters between steps, on the simulation thread. A
+  // snapshot published before is dropped, so the next step can't undo them.
+  void update(const Parameters &parameters) {
+    std::atomic_store(&pending_, std::shared_ptr<const Snapshot>());
+    current_ = prepare(parameters);
+  }
+  const Parameters &parameters() const { return current_->parameters; }
+
+  // Chooses the coarsest Multiscale factor whose step is within target
+  // relative RMS error of an exact step from the current field, or an exact
+  // plan when none is. Prints the time and error of every factor tried and
+  // of the exact path, which is jump(1) for periodic boundaries.
+  void planMultiscale(double target, std::ostream &log) {
+    // Steps are timed on a copy of the backend that they advance, and the
+    // error is measured on another copy advanced by one untimed step, so
+    // the copies stay out of the timings.
+    const bool fourier = boundary == Boundary::Periodic;
+    std::ostringstream ignored;
+    const auto exactStep = [&](PixelBackEnd &scene) {
+      if (fourier)
+        scene.jump(1, ignored);
+      else
+        scene.step();
+    };
+    auto exact = std::make_unique<PixelBackEnd>(*this);
+    exact->setPlan(ConvPlan());
+    const double exactMs = bench::milliseconds([&] { exactStep(*exact); }, 1);
+    exact = std::make_unique<PixelBackEnd>(*this);
+    exact->setPlan(ConvPlan());
+    exactStep(*exact);
+    log << "multiscale: exact (" << (fourier ? "fft" : "direct") << ") "
+        << exactMs << " ms\n";
+    ConvPlan chosen = plan();
+    if (chosen.method == ConvPlan::Method::Multiscale)
+      chosen = ConvPlan();
+    const Filter &filter = current_->filter;
+    for (size_t factor = 2;
+         factor < std::min(width(), height()) &&
+         factor / 2 <= std::max(filter.width, filter.height) / 2;
+         factor *= 2) {
+      ConvPlan plan = this->plan();
+      plan.method = ConvPlan::Method::Multiscale;
+      plan.factor = factor;
+      auto trial = std::make_unique<PixelBackEnd>(*this);
+      trial->setPlan(plan);
+      const double ms = bench::milliseconds([&] { trial->step(); }, 1);
+      trial = std::make_unique<PixelBackEnd>(*this);
+      trial->setPlan(plan);
+      trial->step();
+      double error = 0.0;
+      double norm = 0.0;
+      for (size_t y = 0; y < height(); ++y) {
+        for (size_t x = 0; x < width(); ++x) {
+          error += std::pow(double(trial->get(x, y)) - exact->get(x, y), 2);
+          norm += std::pow(double(exact->get(x, y)), 2);
+        }
+      }
+      error = norm > 0.0 ? std::sqrt(error / norm) : 0.0;
+      log << "multiscale: factor " << factor << " " << ms << " ms, error "
+          << error << "\n";
+      if (error <= target)
+        chosen = plan;
+    }
+    setPlan(chosen);
+    log << "multiscale: chose " << plan() << "\n";
+  }
+  // Prints the heap memory used per cell of the field. A step briefly holds
+  // the old and the new field at once.
+  void reportMemory(std::ostream &os) const {
+    const double cells = double(width()) * height();
+    const double field = image.bytes() / cells;
+    const double summaries = pyramid.bytes() / cells;
+    os << "Memory per cell: " << field << " B field + " << summaries
+       << " B pyramid = " << field + summaries << " B, "
+       << 2 * field + summaries << " B peak during a step\n";
+  }
+  // Reductions of the field produced by the last step.
+  const FieldStats &stats() const { return stats_; }
+  float get(size_t x, size_t y) const {
+    return image.get(typename Field::Index(x, y));
+  }
+  const T *row(size_t y) const { return image.row(y); }
+  const Pyramid &summaries() const { return pyramid; }
+  size_t width() const { return image.width; }
+  size_t height() const { return image.height; }
+  void setFilter(Filter f) { setFilter(std::vector<Term>{{std::move(f)}}); }
+
+  // Sets the rule to a sum of terms. The kernels of terms without growth
+  // are weighted and merged into one filter over their union footprint,
+  // which the plan applies. When some terms have growth the merged filter
+  // and their kernels are each applied and combined as the plan's rule
+  // says, see ConvPlan::Rule. Either way kernels wider than the halo fall back to
+  // periodic wrapping, as the merged filter of a linear rule does.
+  void setFilter(const std::vector<Term> &terms) {
+    Parameters next = parameters();
+    // Rebuilt rather than assigned, which would keep the old kernels'
+    // extents.
+    next.terms.clear();
+    next.terms.insert(next.terms.end(), terms.begin(), terms.end());
+    update(next);
+  }
+
+  // Advances n generations at once. With periodic wrap a step is a circular
+  // convolution, so n steps are one convolution with the filter's n-th
+  // power, a pointwise power of its spectrum, at O(N log N) for any n. The
+  // result is the exact linear one: per step rounding of cell types other
+  // than float and double does not happen. Other boundaries and rules with
+  // growth are not circular convolutions, so they are stepped n times
+  // instead. Warns on log when the result may be less precise than a float
+  // cell.
+  void jump(size_t n, std::ostream &log = std::cerr) {
+    const trace::Scope scope("jump");
+    adopt();
+    const Filter &filter = current_->filter;
+    if (boundary != Boundary::Periodic || !current_->growing.empty()) {
+      log << "jump: only exact for linear rules with periodic boundaries, "
+          << "stepping " << n << " generations\n";
+      for (size_t i = 0; i < n; ++i) {
+        step();
+      }
+      return;
+    }
+    using fourier::Coefficient;
+    const size_t w = width();
+    const size_t h = height();
+    const double before = stats_.sum;
+    std::vector<Coefficient> field(w * h);
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) {
+        field[y * w + x] = image.get(x, y);
+      }
+    }
+    // A step computes sum over taps of f(fx, fy) * in(x + dx, y + dy), with
+    // (dx, dy) the tap's offset from the filter center. That is a circular
+    // convolution with the filter mirrored about its center.
+    std::vector<Coefficient> kernel(w * h);
+    for (size_t fy = 0; fy < filter.height; ++fy) {
+      for (size_t fx = 0; fx < filter.width; ++fx) {
+        const long dx = long(fx) - long(filter.width / 2);
+        const long dy = long(fy) - long(filter.height / 2);
+        const size_t x = ((-dx % long(w)) + w) % w;
+        const size_t y = ((-dy % long(h)) + h) % h;
+        kernel[y * w + x] += filter.get(fx, fy);
+      }
+    }
+    fourier::transform2d(field, w, h, false);
+    fourier::transform2d(kernel, w, h, false);
+
+    // The forward transform leaves a rounding error of about
+    // DBL_EPSILON * log2(N) of the field's spectral norm in every
+    // frequency, which the power scales like the signal there. The n-th
+    // power itself loses n * DBL_EPSILON of each phase.
+    double inputNorm = 0.0;
+    double signal = 0.0;
+    double noise = 0.0;
+    double maxGain = 0.0;
+    for (size_t i = 0; i < w * h; ++i) {
+      const double gain = std::abs(kernel[i]);
+      const double power = std::pow(gain, double(n));
+      maxGain = std::max(maxGain, gain);
+      inputNorm += std::norm(field[i]);
+      field[i] *= std::polar(
+          power, std::fmod(double(n) * std::arg(kernel[i]), 2 * M_PI));
+      signal += std::norm(field[i]);
+      noise += power * power;
+    }
+    const double rounding = DBL_EPSILON * std::log2(double(w * h) + 1.0);
+    const double error =
+        (signal > 0.0 ? rounding * std::sqrt(inputNorm / (w * h) * noise /
+                                             signal)
+                      : 0.0) +
+        double(n) * DBL_EPSILON * M_PI;
+    if (error > FLT_EPSILON) {
+      log << "jump: estimated relative error " << error << " after " << n
+          << " generations exceeds float precision\n";
+    }
+    if (n * std::log(maxGain) > std::log(FLT_MAX / (1.0 + std::sqrt(inputNorm))))
+      log << "jump: the filter amplifies some frequencies by " << maxGain
+          << " per generation, the field overflows within " << n
+          << " generations\n";
+
+    fourier::transform2d(field, w, h, true);
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) {
+        image.set(x, y, field[y * w + x].real());
+      }
+    }
+    pyramid.rebuild(image);
+    stats_ = FieldStats();
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) {
+        stats_.add(image.get(x, y));
+      }
+    }
+    stats_.drift = stats_.sum - before;
+  }
+  void setPlan(const ConvPlan &plan) {
+    Parameters next = parameters();
+    next.plan = plan;
+    update(next);
+  }
+
+  // Chooses the Shells plan with the fewest boxes per cell whose filter is
+  // within target relative L2 error of the exact one, and keeps the current
+  // plan when none is. Prints the error of every candidate. The filter has
+  // to fit in the halo.
+  void planShells(double target, std::ostream &log) {
+    const Filter &filter = current_->filter;
+    if (image.halo < std::max(filter.width, filter.height) / 2) {
+      log << "shells: the filter is wider than the halo\n";
+      return;
+    }
+    ConvPlan chosen = plan();
+    size_t fewest = std::numeric_limits<size_t>::max();
+    for (const size_t shells : {1, 2, 4, 8, 16, 32}) {
+      for (const size_t steps : {1, 2, 4, 8}) {
+        const auto fit = filters::fitShells(filter, shells, steps);
+        log << "shells: " << shells << " x " << steps << " steps, "
+            << fit.boxes.size() << " boxes, error " << fit.error
+            << " (L1 " << fit.l1Error << ")\n";
+        if (fit.error <= target && fit.boxes.size() < fewest) {
+          fewest = fit.boxes.size();
+          chosen = plan();
+          chosen.method = ConvPlan::Method::Shells;
+          chosen.shells = shells;
+          chosen.steps = steps;
+        }
+      }
+    }
+    setPlan(chosen);
+    log << "shells: chose " << plan() << "\n";
+  }
+
+  // Chooses the Sparse plan with the fewest taps whose filter is within
+  // target relative L2 error of the exact one, and keeps the current plan
+  // when none drops a tap or the step is not faster than with the current
+  // plan. Prints the taps, runs and error of every threshold tried. The
+  // filter has to fit in the halo.
+  void planSparse(double target, std::ostream &log) {
+    const Filter &filter = current_->filter;
+    if (image.halo < std::max(filter.width, filter.height) / 2) {
+      log << "sparse: the filter is wider than the halo\n";
+      return;
+    }
+    ConvPlan chosen = plan();
+    for (const double threshold : {0.0, 1e-4, 1e-3, 3e-3, 1e-2, 3e-2, 0.1}) {
+      const auto sparse = Field::sparsify(filter, threshold);
+      log << "sparse: threshold " << threshold << ", "
+          << sparse.weights.size() << " of " << sparse.taps << " taps in "
+          << sparse.runs.size() << " runs, error " << sparse.error
+          << " (L1 " << sparse.l1Error << ")\n";
+      if (sparse.error <= target && sparse.weights.size() < sparse.taps) {
+        chosen = plan();
+        chosen.method = ConvPlan::Method::Sparse;
+        chosen.threshold = threshold;
+      }
+    }
+    if (chosen.method == ConvPlan::Method::Sparse) {
+      // Both trials are copied before either is timed, so only their steps
+      // are measured.
+      PixelBackEnd currentTrial(*this);
+      PixelBackEnd sparseTrial(*this);
+      sparseTrial.setPlan(chosen);
+      const double current =
+          bench::milliseconds([&] { currentTrial.step(); }, 3);
+      const double sparse = bench::milliseconds([&] { sparseTrial.step(); }, 3);
+      log << "sparse: " << sparse << " ms against " << current
+          << " ms with " << plan() << "\n";
+      if (sparse < current)
+        setPlan(chosen);
+    }
+    log << "sparse: chose " << plan() << "\n";
+  }
+  const ConvPlan &plan() const { return current_->parameters.plan; }
+
+  // Picks the fastest ConvPlan for this machine, field and filter. Results
+  // are kept in the cache file keyed by CPU model, cell type, layout, grid
+  // shape and filter, plus the kernels of terms with growth, so only the
+  // first run with a configuration times the candidates, on a copy of the
+  // backend. Rules with growth also time separate passes and the fused
+  // pass.
+  void autotune(const std::string &cachePath, std::ostream &log) {
+    const trace::Scope scope("autotune");
+    const Filter &filter = current_->filter;
+    std::ostringstream key;
+    key << tuning::cpuModel() << "|" << typeid(Field).name() << "|"
+        << width() << "x" << height() << "|" << std::hex
+        << tuning::digest(filter);
+    for (const auto &term : current_->growing) {
+      key << "|" << tuning::digest(term.kernel);
+    }
+    std::ifstream cache(cachePath);
+    std::string line;
+    bool cached = false;
+    ConvPlan fastest;
+    while (std::getline(cache, line)) {
+      const auto split = line.find('\t');
+      if (line.substr(0, split) == key.str()) {
+        const auto end = line.find('\t', split + 1);
+        std::istringstream(line.substr(split + 1, end - split - 1)) >> fastest;
+        cached = true;
+      }
+    }
+    if (cached) {
+      setPlan(fastest);
+      log << "Autotune: cached plan " << plan() << "\n";
+      return;
+    }
+
+    std::vector<ConvPlan> methods(1);
+    std::vector<typename Field::Compute> columns;
+    std::vector<typename Field::Compute> rows;
+    if (Field::factorize(filter, columns, rows))
+      methods.emplace_back().method = ConvPlan::Method::Separable;
+    // Sparse at threshold 0 is exact, and worth timing when the filter has
+    // zero taps.
+    const auto sparse = Field::sparsify(filter, 0.0);
+    if (sparse.weights.size() < sparse.taps)
+      methods.emplace_back().method = ConvPlan::Method::Sparse;
+    for (const size_t tile : {2, 4}) {
+      if (filter.width != filter.height || filter.width % 2 == 0 ||
+          tile + filter.width > 9)
+        continue;
+      auto &plan = methods.emplace_back();
+      plan.method = ConvPlan::Method::Winograd;
+      plan.tile = tile;
+    }
+    // Rules with growth also try each method in separate passes, and the
+    // fused pass.
+    if (!current_->growing.empty()) {
+      for (size_t i = 0, n = methods.size(); i < n; ++i) {
+        methods.push_back(methods[i]);
+        methods.back().rule = ConvPlan::Rule::Separate;
+      }
+      methods.emplace_back().rule = ConvPlan::Rule::Fused;
+    }
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    std::set<size_t> threadCounts{1, std::max<size_t>(1, cores / 2), cores};
+    double best = std::numeric_limits<double>::infinity();
+    PixelBackEnd trial = *this;
+    for (const auto &method : methods) {
+      for (const size_t stripRows : {2, 8, 32}) {
+        for (const size_t threads : threadCounts) {
+          ConvPlan plan = method;
+          plan.stripRows = stripRows;
+          plan.threads = threads;
+          trial.setPlan(plan);
+          const double ms = bench::milliseconds([&] { trial.step(); }, 3);
+          log << "Autotune: " << trial.plan() << " " << ms << " ms\n";
+          if (ms < best) {
+            best = ms;
+            fastest = trial.plan();
+          }
+        }
+      }
+    }
+    setPlan(fastest);
+    log << "Autotune: chose " << plan() << "\n";
+    std::ofstream(cachePath, std::ios::app)
+        << key.str() << "\t" << plan() << "\t" << best << "\n";
+  }
+  void setBoundary(Boundary b) { boundary = b; }
+  Boundary getBoundary() const { return boundary; }
+  // Edits keep stats_.sum current, as the baseline of the next drift.
+  void setZero() {
+    image.setZero();
+    pyramid.rebuild(image);
+    stats_.sum = 0.0;
+  }
+  void add(size_t x, size_t y) {
+    const double old = image.get(x, y);
+    image.add(x, y, parameters().mouseAdd);
+    pyramid.update(image, x, y);
+    stats_.sum += image.get(x, y) - old;
+  }
+  void mult(size_t x, size_t y) {
+    const double old = image.get(x, y);
+    image.mult(x, y, parameters().mouseMult);
+    pyramid.update(image, x, y);
+    stats_.sum += image.get(x, y) - old;
+  }
+
+  // Places a point with a given value in the middle of the canvas.
+  void seed(float sum) {
+    // An even extent has two middle cells, which share the value.
+    const size_t x0 = (image.width - 1) / 2;
+    const size_t y0 = (image.height - 1) / 2;
+    const size_t xEnd = image.width / 2 + 1;
+    const size_t yEnd = image.height / 2 + 1;
+    const float value = sum / ((xEnd - x0) * (yEnd - y0));
+    for (size_t y = y0; y < yEnd; ++y) {
+      for (size_t x = x0; x < xEnd; ++x) {
+        stats_.sum -= image.get(x, y);
+        image.set(x, y, value);
+        stats_.sum += image.get(x, y);
+      }
+    }
+    pyramid.rebuild(image);
+  }
+
+private:
+  Field image;
+  // The parameters of the current step, and those published for the next.
+  std::shared_ptr<const Snapshot> current_;
+  std::shared_ptr<const Snapshot> pending_;
+  Pyramid pyramid;
+  FieldStats stats_;
+  // The integral image of Shells steps, kept between them.
+  std::vector<double> integral_;
+  // The passes of separate rule steps, kept between them.
+  std::vector<Compute> passes_;
+  Boundary boundary = Boundary::Periodic;
+
+  // Makes a published snapshot current, at the start of a step.
+  void adopt() {
+    if (auto next = std::atomic_exchange(&pending_,
+                                         std::shared_ptr<const Snapshot>()))
+      current_ = std::move(next);
+  }
+
+  // A step approximated on the grid coarsened by plan().factor: the block
+  // means are convolved with the coarsened filter and interpolated back.
+  // Costs about N K^2 / factor^4 multiplies for a K x K filter.
+  Field multiscaleStep(const FrameTarget *frame) {
+    const auto &kernel = current_->coarse;
+    auto coarse = image.downsample(
+        plan().factor, std::max(kernel.width, kernel.height) / 2 + 1);
+    coarse.fillHalo(boundary);
+    auto result = decltype(coarse)::conv2d(coarse, kernel);
+    result.fillHalo(boundary);
+    return Field::upsample(result, plan().factor, width(), height(),
+                           image.halo, &pyramid, frame, &stats_, plan());
+  }
+};
+
+template <typename T, typename Layout>
+std::ostream &operator<<(std::ostream &os, const Image<T, Layout> &image) {
+  for (size_t y = 0; y < image.height; ++y) {
+    for (size_t x = 0; x < image.width; ++x) {
+      os << image.get(x, y) << ", ";
+    }
+  }
+  return os;
+}
+
+namespace filters {
+template <typename T, typename Layout>
+Image<T, Layout> normalize(const Image<T, Layout> &filter) {
+  return filter / filter.sum();
+}
+
+template <typename T = float> Image<T> circular(size_t size, float gain) {
+  Image<T> filter(size, size);
+  float center = 0;
+  for (int x = 0; x < size; ++x) {
+    for (int y = 0; y < size; ++y) {
+      const int rx = x - size / 2;
+      const int ry = y - size / 2;
+      float centerDistance = distance({center, center}, {rx, ry});
+      filter.set(x, y, 1.0f / (1 + centerDistance));
+    }
+  }
+  filter *= gain / filter.sum();
+  return filter;
+}
+
+template <typename T = float> Image<T> ring(size_t size, float gain) {
+  Image<T> filter(size, size);
+  float center = 0;
+  for (int x = 0; x < size; ++x) {
+    for (int y = 0; y < size; ++y) {
+      const int rx = x - size / 2;
+      const int ry = y - size / 2;
+      float centerDistance = distance({center, center}, {rx, ry});
+      auto magnitude = fabs(centerDistance - (size / 2));
+      filter.set(x, y, magnitude);
+    }
+  }
+  filter /= filter.sum();
   filter = (filter - filter.average()) * 2;
   return filter;
 }
 
 } // namespace filters
 
+// The supported cell types and layouts, compiled once here.
+#define INSTANTIATE_FIELD(T)                                                   \
+  template class Image<T, RowMajor>;                                           \
+  template class Image<T, Tiled>;                                              \
+  template class PixelBackEnd<T, RowMajor>;                                    \
+  template class PixelBackEnd<T, Tiled>;
+
+INSTANTIATE_FIELD(float)
+INSTANTIATE_FIELD(double)
+INSTANTIATE_FIELD(int16_t)
+#if defined(__FLT16_MAX__)
+INSTANTIATE_FIELD(_Float16)
+#endif
+#undef INSTANTIATE_FIELD
+
+// Filters hold the Compute type of the field they are applied to.
+template Image<float> filters::circular(size_t, float);
+template Image<double> filters::circular(size_t, float);
+template Image<float> filters::ring(size_t, float);
+template Image<double> filters::ring(size_t, float);
+
+namespace input {
+// A change of the input a frame sees, tagged with the generation the frame
+// started at. Keys and mouse buttons go down (b = 1) or up (b = 0), Move
+// puts the mouse at screen pixel (a, b), Wheel turns it by a, and Elapsed
+// is the frame time in microseconds, only kept for frames that pan.
+struct Event {
+  enum class Type : char {
+    Key = 'k',
+    Button = 'b',
+    Move = 'm',
+    Wheel = 'w',
+    Elapsed = 't'
+  };
+  uint64_t generation;
+  Type type;
+  int32_t a;
+  int32_t b;
+};
+
+// A recorded session: the screen it ran on and its events in order.
+struct Log {
+  int32_t screenWidth = 0;
+  int32_t screenHeight = 0;
+  std::vector<Event> events;
+};
+
+constexpr int32_t keyCount = olc::Key::PERIOD + 1;
+
+// Writes a header line, then a line per event with the generations since
+// the previous event, its type and its values, a few bytes each.
+void write(std::ostream &out, const Log &log) {
+  out << "input 1 " << log.screenWidth << " " << log.screenHeight << "\n";
+  uint64_t generation = 0;
+  for (const auto &event : log.events) {
+    out << event.generation - generation << " " << char(event.type) << " "
+        << event.a << " " << event.b << "\n";
+    generation = event.generation;
+  }
+}
+
+// Reads a log written by write. False if it isn't one.
+bool read(std::istream &in, Log &log) {
+  std::string magic;
+  int version = 0;
+  if (!(in >> magic >> version >> log.screenWidth >> log.screenHeight) ||
+      magic != "input" || version != 1)
+    return false;
+  uint64_t generation = 0;
+  uint64_t delta;
+  char type;
+  Event event;
+  while (in >> delta >> type >> event.a >> event.b) {
+    generation += delta;
+    event.generation = generation;
+    event.type = Event::Type(type);
+    log.events.push_back(event);
+  }
+  return true;
+}
+
+// Plays a log back as the input of successive frames, deriving pressed and
+// released from held the way the engine does.
+class Replay {
+public:
+  explicit Replay(Log log) : log(std::move(log)) {}
+
+  // Moves to the frame starting at generation, applying the events of every
+  // frame up to it.
+  void advance(uint64_t generation) {
+    for (auto &key : keys) {
+      key.bPressed = key.bReleased = false;
+    }
+    for (auto &button : buttons) {
+      button.bPressed = button.bReleased = false;
+    }
+    wheel = 0;
+    elapsed = 0.0f;
+    for (; next < log.events.size() &&
+           log.events[next].generation <= generation;
+         ++next) {
+      const Event &event = log.events[next];
+      switch (event.type) {
+      case Event::Type::Key:
+        if (event.a >= 0 && event.a < keyCount)
+          press(keys[event.a], event.b);
+        break;
+      case Event::Type::Button:
+        if (event.a >= 0 && event.a < olc::nMouseButtons)
+          press(buttons[event.a], event.b);
+        break;
+      case Event::Type::Move:
+        x = event.a;
+        y = event.b;
+        break;
+      case Event::Type::Wheel:
+        wheel += event.a;
+        break;
+      case Event::Type::Elapsed:
+        elapsed = event.a * 1e-6f;
+        break;
+      }
+    }
+  }
+
+  const Log &recorded() const { return log; }
+  bool finished() const { return next == log.events.size(); }
+  olc::HWButton key(olc::Key k) const { return keys[k]; }
+  olc::HWButton button(uint32_t b) const { return buttons[b]; }
+  int32_t mouseX() const { return x; }
+  int32_t mouseY() const { return y; }
+  int32_t mouseWheel() const { return wheel; }
+  float frameTime() const { return elapsed; }
+
+private:
+  Log log;
+  size_t next = 0;
+  olc::HWButton keys[keyCount];
+  olc::HWButton buttons[olc::nMouseButtons];
+  int32_t x = 0;
+  int32_t y = 0;
+  int32_t wheel = 0;
+  float elapsed = 0.0f;
+
+  static void press(olc::HWButton &button, bool down) {
+    if (down)
+      button.bPressed = !button.bHeld;
+    else
+      button.bReleased = button.bHeld;
+    button.bHeld = down;
+  }
+};
+} // namespace input
+
+template <typename T = float, typename Layout = RowMajor>
 class ConvolutionVisualizer : public olc::PixelGameEngine {
 public:
-  ConvolutionVisualizer(size_t sceneSize, size_t filterSize, float gain)
-      : scene(sceneSize, sceneSize, filterSize),
-        positions(makePositions(sceneSize, sceneSize)) {
+  ConvolutionVisualizer(size_t width, size_t height, size_t filterSize,
+                        float gain)
+      : scene(width, height, filterSize), filterSize(filterSize) {
     sAppName = "ConvolutionVisualizer";
     scene.seed(30000.0f);
-    scene.setFilter(filters::circular(filterSize, gain));
+    wanted.terms.push_back({filters::circular<Compute>(filterSize, 1)});
+    wanted.gain = gain;
+    scene.update(wanted);
+  }
+
+  void reportMemory(std::ostream &os) const { scene.reportMemory(os); }
+  void autotune(const std::string &cachePath) {
+    scene.autotune(cachePath, std::cout);
+    wanted.plan = scene.plan();
   }
-  struct Position {
-    Position(size_t a, size_t b) {
-      x = a;
-      y = b;
+  // Reads parameters from lines of a name and a value: gain, mouseAdd,
+  // mouseMult and filterSize. They take effect once rebuilt off the
+  // simulation thread; L reads the file again. A filterSize has to be odd
+  // and fit in the grid, others are reported and ignored.
+  void loadParameters(const std::string &path) {
+    const trace::Scope scope("load parameters");
+    parametersPath = path;
+    std::ifstream in(path);
+    if (!in) {
+      std::cerr << "Cannot read parameters from " << path << "\n";
+      return;
     }
-    size_t x;
-    size_t y;
-  };
+    std::string name;
+    double value;
+    while (in >> name >> value) {
+      if (name == "gain")
+        wanted.gain = value;
+      else if (name == "mouseAdd")
+        wanted.mouseAdd = value;
+      else if (name == "mouseMult")
+        wanted.mouseMult = value;
+      else if (name == "filterSize") {
+        const size_t largest = std::min(scene.width(), scene.height());
+        if (value >= 1 && value <= largest && value == std::floor(value) &&
+            size_t(value) % 2 == 1)
+          filterSize = size_t(value);
+        else
+          std::cerr << "filterSize has to be an odd number from 1 to "
+                    << largest << ", not " << value << "\n";
+      }
+      else
+        std::cerr << "Unknown parameter " << name << "\n";
+    }
+    dirty = true;
+  }
+
+  // Logs the input of every frame to path, written when the engine stops.
+  void recordInput(const std::string &path) { recordPath = path; }
+  // Takes the input of every frame from the log at path instead of the
+  // engine, at the generations it was recorded at. False if it can't be
+  // read.
+  bool replayInput(const std::string &path) {
+    const trace::Scope scope("read input");
+    std::ifstream in(path);
+    input::Log log;
+    if (!input::read(in, log)) {
+      std::cerr << "Cannot read an input log from " << path << "\n";
+      return false;
+    }
+    replay = std::make_unique<input::Replay>(std::move(log));
+    return true;
+  }
+
+  // Which statistic a screen pixel shows when it covers several cells.
+  enum class Reduction { Mean, Min, Max };
 
 public:
   bool OnUserCreate() override {
     // scene.setZero();
+    trace::nameThread("engine");
+    zoom = zoomToFit();
+    if (replay && (replay->recorded().screenWidth != ScreenWidth() ||
+                   replay->recorded().screenHeight != ScreenHeight()))
+      std::cerr << "Input was recorded on a "
+                << replay->recorded().screenWidth << "x"
+                << replay->recorded().screenHeight
+                << " screen, mouse positions will differ\n";
+    recording.screenWidth = ScreenWidth();
+    recording.screenHeight = ScreenHeight();
+    return true;
+  }
+
+  bool OnUserDestroy() override {
+    if (!recordPath.empty()) {
+      const trace::Scope scope("write input");
+      std::ofstream out(recordPath);
+      input::write(out, recording);
+      std::cout << "Recorded " << recording.events.size() << " input events to "
+                << recordPath << "\n";
+    }
     return true;
   }
 
   bool OnUserUpdate(float fElapsedTime) override {
+    const trace::Scope scope("frame");
     auto start = std::chrono::system_clock::now();
-    // std::for_each(std::execution::par, std::begin(positions),
-    //              std::end(positions), [&](Position pos) {
-    //                const float value = scene.get(pos.x, pos.y);
-    //                const auto r = (sin(value) + 1.0f) / 2.0f;
-    //                const auto g = (sin(value * 3.0f) + 1.0f) / 2.0f;
-    //                const auto b = (sin(value * 5.0f) + 1.0f) / 2.0f;
-    //                olc::Pixel pixel = olc::PixelF(r, g, b);
-    //                Draw(pos.x, pos.y, pixel);
-    //              });
-    std::for_each(std::execution::par, std::begin(positions),
-                  std::end(positions), [&](Position pos) {
-                    const float value =
-                        (sin(scene.get(pos.x, pos.y)) + 1.0f) / 2.0f;
-                        olc::Pixel pixel = olc::PixelF(value, value, value);
-                    Draw(pos.x, pos.y, pixel);
-                  });
-    if (GetMouse(0).bHeld) {
-      scene.add(GetMouseX(), GetMouseY());
-      scene.mult(GetMouseX(), GetMouseY());
-    }
-    scene.step();
+    {
+      const trace::Scope scope("input");
+      if (replay) {
+        replay->advance(generation);
+        fElapsedTime = replay->frameTime();
+      } else if (!recordPath.empty()) {
+        fElapsedTime = record(fElapsedTime);
+      }
+      updateViewport(fElapsedTime);
+      if (key(olc::Key::F).bPressed)
+        fused = !fused;
+      if (mouse(0).bHeld) {
+        const size_t x = viewX + cellsAt(mouseX());
+        const size_t y = viewY + cellsAt(mouseY());
+        if (x < scene.width() && y < scene.height()) {
+          scene.add(x, y);
+          scene.mult(x, y);
+        }
+      }
+    }
+    if (fused && zoom == 0) {
+      // At one cell per pixel the step itself writes the visible cells.
+      if (size_t(ScreenWidth()) > scene.width() ||
+          size_t(ScreenHeight()) > scene.height())
+        Clear(olc::BLACK);
+      const FrameTarget frame{GetDrawTarget()->GetData(),
+                              size_t(ScreenWidth()),
+                              size_t(viewX),
+                              size_t(viewY),
+                              size_t(ScreenWidth()),
+                              size_t(ScreenHeight())};
+      scene.step(&frame);
+    } else {
+      render();
+      scene.step();
+    }
+    ++generation;
+    if (key(olc::Key::T).bPressed)
+      showStats = !showStats;
+    if (key(olc::Key::B).bPressed)
+      scene.setBoundary(Boundary((int(scene.getBoundary()) + 1) % 4));
+    if (key(olc::Key::J).bPressed) {
+      scene.jump(jumpLength, std::cout);
+      generation += jumpLength;
+    }
+    updateParameters();
+    if (showStats)
+      drawStats();
+    // Once every logged event has been applied the engine's input takes
+    // over again.
+    if (replay && replay->finished()) {
+      std::cout << "Replay: the input log ended at generation " << generation
+                << "\n";
+      replay.reset();
+    }
     auto end = std::chrono::system_clock::now();
     auto diff = std::chrono::duration<float>(end - start);
     // std::cout << "FPS: " << 1.0f / diff.count() << std::endl;
+    lastUpdate = diff.count();
     return true;
   }
 
+  // Seconds spent in the last OnUserUpdate.
+  float updateSeconds() const { return lastUpdate; }
+
+private:
+  using Compute = typename CellTraits<T>::Compute;
+  using Parameters = typename PixelBackEnd<T, Layout>::Parameters;
+
+  PixelBackEnd<T, Layout> scene;
+  // Parameters asked for by keys and the parameters file, published to the
+  // scene once a rebuild has prepared them. dirty marks changes made since
+  // the last rebuild started.
+  Parameters wanted;
+  size_t filterSize;
+  std::string parametersPath;
+  bool dirty = false;
+  // Declared after scene so that destruction waits for it first.
+  std::future<void> rebuild;
+  // Grid cell shown in the top left corner of the screen.
+  float viewX = 0.0f;
+  float viewY = 0.0f;
+  // Zoom level: a level z > 0 folds 2^z x 2^z cells into one screen pixel,
+  // z < 0 magnifies every cell to 2^-z x 2^-z pixels.
+  int zoom = 0;
+  static constexpr int minZoom = -3;
+  Reduction reduction = Reduction::Mean;
+  // Whether to colour map the field inside the step instead of in a separate
+  // pass over the visible cells.
+  bool fused = true;
+  bool showStats = false;
+  float lastUpdate = 0.0f;
+  // Generations computed so far, which key recorded and replayed input.
+  uint64_t generation = 0;
+  // Input logged for recordPath, and the log being replayed if any.
+  input::Log recording;
+  std::string recordPath;
+  std::unique_ptr<input::Replay> replay;
+  int32_t recordedX = -1;
+  int32_t recordedY = -1;
+  // Generations skipped by a fast forward.
+  static constexpr size_t jumpLength = 1000;
+
+  // The input of the current frame, from the engine or the replayed log.
+  olc::HWButton key(olc::Key k) { return replay ? replay->key(k) : GetKey(k); }
+  olc::HWButton mouse(uint32_t b) {
+    return replay ? replay->button(b) : GetMouse(b);
+  }
+  int32_t mouseX() { return replay ? replay->mouseX() : GetMouseX(); }
+  int32_t mouseY() { return replay ? replay->mouseY() : GetMouseY(); }
+  int32_t mouseWheel() {
+    return replay ? replay->mouseWheel() : GetMouseWheel();
+  }
+  bool panning() {
+    return key(olc::Key::LEFT).bHeld || key(olc::Key::A).bHeld ||
+           key(olc::Key::RIGHT).bHeld || key(olc::Key::D).bHeld ||
+           key(olc::Key::UP).bHeld || key(olc::Key::W).bHeld ||
+           key(olc::Key::DOWN).bHeld || key(olc::Key::S).bHeld;
+  }
+
+  // Logs what changed in the engine's input since the last frame. The frame
+  // time only matters to panning, so it's only logged then, in whole
+  // microseconds. Returns the frame time as a replay will read it back, for
+  // the recording run to pan by.
+  float record(float fElapsedTime) {
+    using Type = input::Event::Type;
+    auto &events = recording.events;
+    for (int32_t k = 0; k < input::keyCount; ++k) {
+      const auto state = GetKey(olc::Key(k));
+      if (state.bPressed || state.bReleased)
+        events.push_back({generation, Type::Key, k, state.bHeld});
+    }
+    for (int32_t b = 0; b < olc::nMouseButtons; ++b) {
+      const auto state = GetMouse(b);
+      if (state.bPressed || state.bReleased)
+        events.push_back({generation, Type::Button, b, state.bHeld});
+    }
+    if (GetMouseX() != recordedX || GetMouseY() != recordedY) {
+      recordedX = GetMouseX();
+      recordedY = GetMouseY();
+      events.push_back({generation, Type::Move, recordedX, recordedY});
+    }
+    if (GetMouseWheel() != 0)
+      events.push_back({generation, Type::Wheel, GetMouseWheel(), 0});
+    if (!panning())
+      return fElapsedTime;
+    const int32_t micros = int32_t(fElapsedTime * 1e6f);
+    events.push_back({generation, Type::Elapsed, micros, 0});
+    return micros * 1e-6f;
+  }
+
+  // Number of cells covered by the first n screen pixels along an axis.
+  size_t cellsAt(int n) const {
+    return zoom >= 0 ? size_t(n) << zoom : size_t(n) >> -zoom;
+  }
+
+  void updateViewport(float fElapsedTime) {
+    const int oldZoom = zoom;
+    if (mouseWheel() > 0 || key(olc::Key::Q).bPressed)
+      --zoom;
+    if (mouseWheel() < 0 || key(olc::Key::E).bPressed)
+      ++zoom;
+    zoom = std::clamp(zoom, minZoom, zoomToFit());
+    if (zoom != oldZoom) {
+      // Keep the cell under the screen center in place.
+      const float scale = std::ldexp(1.0f, zoom - oldZoom);
+      viewX += ScreenWidth() / 2.0f * std::ldexp(1.0f, oldZoom) * (1 - scale);
+      viewY += ScreenHeight() / 2.0f * std::ldexp(1.0f, oldZoom) * (1 - scale);
+    }
+
+    // Pan by half a screen per second.
+    const float pan = fElapsedTime * std::ldexp(ScreenWidth() / 2.0f, zoom);
+    if (key(olc::Key::LEFT).bHeld || key(olc::Key::A).bHeld)
+      viewX -= pan;
+    if (key(olc::Key::RIGHT).bHeld || key(olc::Key::D).bHeld)
+      viewX += pan;
+    if (key(olc::Key::UP).bHeld || key(olc::Key::W).bHeld)
+      viewY -= pan;
+    if (key(olc::Key::DOWN).bHeld || key(olc::Key::S).bHeld)
+      viewY += pan;
+    viewX = std::clamp(viewX, 0.0f,
+                       std::max(0.0f, float(scene.width()) -
+                                          cellsAt(ScreenWidth())));
+    viewY = std::clamp(viewY, 0.0f,
+                       std::max(0.0f, float(scene.height()) -
+                                          cellsAt(ScreenHeight())));
+
+    if (key(olc::Key::K1).bPressed)
+      reduction = Reduction::Mean;
+    if (key(olc::Key::K2).bPressed)
+      reduction = Reduction::Min;
+    if (key(olc::Key::K3).bPressed)
+      reduction = Reduction::Max;
+  }
+
+  // Z and X scale the gain down and up while held, C and V halve and double
+  // the mouse edit. Kernels are rebuilt on another thread, never more than
+  // one rebuild at a time, and the scene swaps them in at its next step.
+  void updateParameters() {
+    const Compute nudge = 1.0001;
+    if (key(olc::Key::Z).bHeld) {
+      wanted.gain /= nudge;
+      dirty = true;
+    }
+    if (key(olc::Key::X).bHeld) {
+      wanted.gain *= nudge;
+      dirty = true;
+    }
+    if (key(olc::Key::C).bPressed) {
+      wanted.mouseAdd /= 2;
+      dirty = true;
+    }
+    if (key(olc::Key::V).bPressed) {
+      wanted.mouseAdd *= 2;
+      dirty = true;
+    }
+    if (key(olc::Key::L).bPressed && !parametersPath.empty())
+      loadParameters(parametersPath);
+    if (!dirty || (rebuild.valid() && rebuild.wait_for(std::chrono::seconds(
+                                          0)) != std::future_status::ready))
+      return;
+    Parameters next = wanted;
+    next.plan = scene.plan();
+    rebuild = std::async(std::launch::async, [this, next, size = filterSize] {
+      trace::nameThread("rebuild");
+      Parameters built = next;
+      built.terms.clear();
+      built.terms.push_back({filters::circular<Compute>(size, 1)});
+      scene.publish(scene.prepare(built));
+    });
+    // Recorded and replayed runs swap at the next step, so that the same
+    // input changes the rule at the same generation.
+    if (replay || !recordPath.empty())
+      rebuild.wait();
+    dirty = false;
+  }
+
+  void drawStats() {
+    const auto &stats = scene.stats();
+    const auto &parameters = scene.parameters();
+    const std::string lines[] = {
+        "sum    " + std::to_string(stats.sum),
+        "drift  " + std::to_string(stats.drift),
+        "min    " + std::to_string(stats.min),
+        "max    " + std::to_string(stats.max),
+        "active " + std::to_string(stats.active),
+        "gain   " + std::to_string(parameters.gain),
+        "add    " + std::to_string(parameters.mouseAdd)};
+    int y = 2;
+    for (const auto &line : lines) {
+      DrawString(2, y, line, olc::RED);
+      y += 10;
+    }
+  }
+
+  // Smallest zoom level at which the whole grid fits on screen.
+  int zoomToFit() {
+    int level = 0;
+    while ((size_t(ScreenWidth()) << level) < scene.width() ||
+           (size_t(ScreenHeight()) << level) < scene.height()) {
+      ++level;
+    }
+    return level;
+  }
+
+  // Converts only the visible part of the grid to pixels. When zoomed out
+  // each screen pixel shows the selected reduction of the block of cells
+  // under it, read from the scene's summary pyramid, so the work per frame
+  // follows the screen size.
+  void render() {
+    const trace::Scope scope("render");
+    const auto &summaries = scene.summaries();
+    const size_t originX = size_t(viewX) >> std::max(zoom, 0);
+    const size_t originY = size_t(viewY) >> std::max(zoom, 0);
+    const size_t width = zoom > 0 ? summaries.level(zoom).width : scene.width();
+    const size_t height =
+        zoom > 0 ? summaries.level(zoom).height : scene.height();
+    olc::Pixel *screen = GetDrawTarget()->GetData();
+    const size_t screenWidth = ScreenWidth();
+    // Screen pixels covered by the cells right of the origin.
+    const size_t covered =
+        std::min(screenWidth, (width - std::min(originX, width))
+                                  << std::max(-zoom, 0));
+    std::for_each(
+        std::execution::par, boost::counting_iterator<int>(0),
+        boost::counting_iterator<int>(ScreenHeight()), [&](int sy) {
+          const trace::Scope scope("render row");
+          olc::Pixel *out = screen + sy * screenWidth;
+          const size_t y = originY + (zoom < 0 ? sy >> -zoom : sy);
+          if (y >= height) {
+            std::fill(out, out + screenWidth, olc::BLACK);
+            return;
+          }
+          if (zoom > 0) {
+            const auto *row = summaries.row(zoom, y) + originX;
+            for (size_t sx = 0; sx < covered; ++sx) {
+              out[sx] = colormap(reduction == Reduction::Min   ? row[sx].min
+                                 : reduction == Reduction::Max ? row[sx].max
+                                                               : row[sx].mean);
+            }
+          } else if (const T *row = scene.row(y)) {
+            for (size_t sx = 0; sx < covered; ++sx) {
+              out[sx] = colormap(row[originX + (sx >> -zoom)]);
+            }
+          } else {
+            for (size_t sx = 0; sx < covered; ++sx) {
+              out[sx] = colormap(scene.get(originX + (sx >> -zoom), y));
+            }
+          }
+          std::fill(out + covered, out + screenWidth, olc::BLACK);
+        });
+  }
+};
+
+namespace headless {
+// A platform without a window or input. The engine calls HandleSystemEvent
+// once at the start of every frame; it reports the frame to onFrame and
+// ends the engine thread once frames frames have run.
+class NullPlatform : public olc::Platform {
+public:
+  NullPlatform(size_t frames, std::function<void()> onFrame)
+      : frames(frames), onFrame(std::move(onFrame)) {}
+
+  olc::rcode ApplicationStartUp() override { return olc::OK; }
+  olc::rcode ApplicationCleanUp() override { return olc::OK; }
+  olc::rcode ThreadStartUp() override { return olc::OK; }
+  olc::rcode ThreadCleanUp() override {
+    olc::renderer->DestroyDevice();
+    return olc::OK;
+  }
+  olc::rcode CreateGraphics(bool fullScreen, bool vsync,
+                            const olc::vi2d &viewPos,
+                            const olc::vi2d &viewSize) override {
+    olc::renderer->PrepareDevice();
+    if (olc::renderer->CreateDevice({}, fullScreen, vsync) != olc::OK)
+      return olc::FAIL;
+    olc::renderer->UpdateViewport(viewPos, viewSize);
+    return olc::OK;
+  }
+  olc::rcode CreateWindowPane(const olc::vi2d &, olc::vi2d &,
+                              bool) override {
+    return olc::OK;
+  }
+  olc::rcode SetWindowTitle(const std::string &) override { return olc::OK; }
+  olc::rcode StartSystemEventLoop() override { return olc::OK; }
+  olc::rcode HandleSystemEvent() override {
+    onFrame();
+    if (++frame >= frames)
+      ptrPGE->olc_Terminate();
+    return olc::OK;
+  }
+
+private:
+  size_t frames;
+  size_t frame = 0;
+  std::function<void()> onFrame;
+};
+
+// A renderer that keeps layer textures in memory. Uploading a layer copies
+// its pixels, as a texture upload would, drawing and presenting do nothing.
+class SoftwareRenderer : public olc::Renderer {
+public:
+  void PrepareDevice() override {}
+  olc::rcode CreateDevice(std::vector<void *>, bool, bool) override {
+    return olc::OK;
+  }
+  olc::rcode DestroyDevice() override {
+    textures.clear();
+    return olc::OK;
+  }
+  void DisplayFrame() override {}
+  void PrepareDrawing() override {}
+  void DrawLayerQuad(const olc::vf2d &, const olc::vf2d &,
+                     const olc::Pixel) override {}
+  void DrawDecalQuad(const olc::DecalInstance &) override {}
+  uint32_t CreateTexture(const uint32_t width,
+                         const uint32_t height) override {
+    textures.emplace_back(size_t(width) * height);
+    return uint32_t(textures.size() - 1);
+  }
+  void UpdateTexture(uint32_t id, olc::Sprite *sprite) override {
+    textures[id].assign(sprite->pColData,
+                        sprite->pColData + sprite->width * sprite->height);
+  }
+  void ApplyTexture(uint32_t) override {}
+  void UpdateViewport(const olc::vi2d &, const olc::vi2d &) override {}
+  void ClearBuffer(olc::Pixel, bool) override {}
+
+private:
+  std::vector<std::vector<olc::Pixel>> textures;
+};
+
+// Mean, median, 95th percentile and maximum of times in milliseconds.
+void summarize(const std::string &name, std::vector<double> times,
+               std::ostream &out) {
+  if (times.empty())
+    return;
+  std::sort(times.begin(), times.end());
+  const double mean =
+      std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+  out << std::left << std::setw(8) << name << std::right << std::fixed
+      << std::setprecision(3) << std::setw(10) << mean << std::setw(11)
+      << times[times.size() / 2] << std::setw(10)
+      << times[times.size() * 95 / 100] << std::setw(10) << times.back()
+      << "\n";
+}
+
+// Milliseconds taken by every frame of a run and by its OnUserUpdate.
+struct Timings {
+  std::vector<double> frames;
+  std::vector<double> updates;
+};
+
+// Runs app for frames frames through the engine's own thread and frame
+// loop, on the null platform and software renderer, and returns how long
+// whole frames and their OnUserUpdate took, empty if the engine didn't
+// start. A frame is timed from one HandleSystemEvent call to the next, so
+// one extra frame runs untimed.
+template <typename App>
+Timings run(App &app, int width, int height, int pixelSize, size_t frames) {
+  Timings timings;
+  auto &frameTimes = timings.frames;
+  auto &updateTimes = timings.updates;
+  auto last = std::chrono::steady_clock::now();
+  size_t frame = 0;
+  // Constructing app installed the default platform, replace it.
+  olc::platform = std::make_unique<NullPlatform>(frames + 1, [&] {
+    const auto now = std::chrono::steady_clock::now();
+    if (frame++ > 0) {
+      frameTimes.push_back(
+          std::chrono::duration<double, std::milli>(now - last).count());
+      updateTimes.push_back(app.updateSeconds() * 1000.0);
+    }
+    last = now;
+  });
+  olc::renderer = std::make_unique<SoftwareRenderer>();
+  olc::platform->ptrPGE = &app;
+  olc::renderer->ptrPGE = &app;
+  if (app.Construct(width, height, pixelSize, pixelSize) != olc::OK ||
+      app.Start() != olc::OK)
+    std::cerr << "Headless run failed to start\n";
+  return timings;
+}
+
+// Prints the distribution of the frame and update times of a run.
+void report(const Timings &timings, int width, int height,
+            std::ostream &out) {
+  out << "headless: " << timings.frames.size() << " frames of " << width
+      << "x" << height << " pixels\n"
+      << "           mean ms  median ms    p95 ms    max ms\n";
+  summarize("frame", timings.frames, out);
+  summarize("update", timings.updates, out);
+}
+} // namespace headless
+
+namespace counters {
+// What is counted, in the order of Sample::values. TaskClock is the CPU
+// time of all threads in nanoseconds, the rest are hardware events.
+// VectorOps are retired packed floating point instructions.
+enum Event {
+  TaskClock,
+  Cycles,
+  Instructions,
+  LlcMisses,
+  DtlbMisses,
+  VectorOps,
+  eventCount
+};
+
+// Event totals, and which of them this machine could count.
+struct Sample {
+  std::array<double, eventCount> values{};
+  std::array<bool, eventCount> counted{};
+
+  Sample operator-(const Sample &other) const {
+    Sample difference = *this;
+    for (size_t e = 0; e < eventCount; ++e) {
+      difference.values[e] -= other.values[e];
+    }
+    return difference;
+  }
+};
+
+// Counts events in user space across every thread of the process, with a
+// counter per thread and event since a counter follows a single thread.
+// Threads started later are not counted, so open it after a warm up run
+// has started the thread pool. Events the kernel refuses, as on most
+// virtual machines or with a perf_event_paranoid above 2, stay uncounted.
+class Process {
+public:
+  Process() {
+#if defined(__linux__)
+    std::vector<pid_t> threads;
+    if (DIR *tasks = opendir("/proc/self/task")) {
+      while (const dirent *entry = readdir(tasks)) {
+        if (entry->d_name[0] != '.')
+          threads.push_back(std::atoi(entry->d_name));
+      }
+      closedir(tasks);
+    }
+    for (size_t e = 0; e < eventCount; ++e) {
+      perf_event_attr attr;
+      if (!describe(Event(e), attr))
+        continue;
+      for (const pid_t thread : threads) {
+        const int fd =
+            int(syscall(SYS_perf_event_open, &attr, thread, -1, -1, 0));
+        if (fd >= 0)
+          fds.push_back({Event(e), fd});
+      }
+    }
+#endif
+  }
+  ~Process() {
+#if defined(__linux__)
+    for (const auto &counter : fds) {
+      close(counter.second);
+    }
+#endif
+  }
+  Process(const Process &) = delete;
+  Process &operator=(const Process &) = delete;
+
+  // Current totals. Counters the kernel multiplexed are scaled up by the
+  // share of time they ran.
+  Sample read() const {
+    Sample sample;
+#if defined(__linux__)
+    for (const auto &counter : fds) {
+      uint64_t data[3];
+      if (::read(counter.second, data, sizeof(data)) != sizeof(data) ||
+          data[2] == 0)
+        continue;
+      sample.values[counter.first] += double(data[0]) * data[1] / data[2];
+      sample.counted[counter.first] = true;
+    }
+#endif
+    return sample;
+  }
+
 private:
-  PixelBackEnd scene;
-  const std::vector<Position> positions;
-  const std::vector<Position> makePositions(size_t width, size_t height) {
-    std::vector<Position> v;
-    v.reserve(width * height);
+  std::vector<std::pair<Event, int>> fds;
+
+#if defined(__linux__)
+  static bool describe(Event event, perf_event_attr &attr) {
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch (event) {
+    case TaskClock:
+      attr.type = PERF_TYPE_SOFTWARE;
+      attr.config = PERF_COUNT_SW_TASK_CLOCK;
+      return true;
+    case Cycles:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      return true;
+    case Instructions:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      return true;
+    case LlcMisses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      return true;
+    case DtlbMisses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      return true;
+    case VectorOps:
+      // FP_ARITH_INST_RETIRED with the umasks of every packed width, which
+      // only Intel cores since Broadwell have.
+      if (tuning::cpuVendor() != "GenuineIntel")
+        return false;
+      attr.type = PERF_TYPE_RAW;
+      attr.config = 0xc7 | (0xfc << 8);
+      return true;
+    default:
+      return false;
+    }
+  }
+#endif
+};
+} // namespace counters
+
+namespace bench {
+
+// Step time of a float field in the given layout with a size x size filter.
+template <typename Layout>
+double stepTime(size_t width, size_t height, size_t size) {
+  PixelBackEnd<float, Layout> scene(width, height, size);
+  scene.setFilter(filters::circular(size, 1.0f));
+  scene.seed(1.0f);
+  return milliseconds([&] { scene.step(); }, 3);
+}
+
+// Step time of the RowMajor and Tiled layouts for growing kernel radii.
+void layouts(size_t width, size_t height) {
+  std::cout << "radius  row-major ms  tiled ms  speedup\n";
+  for (size_t radius : {2, 4, 8, 16, 32}) {
+    const size_t size = 2 * radius + 1;
+    const double ms[] = {stepTime<RowMajor>(width, height, size),
+                         stepTime<Tiled>(width, height, size)};
+    std::cout << std::setw(6) << radius << std::setw(14) << ms[0]
+              << std::setw(10) << ms[1] << std::setw(9) << ms[0] / ms[1]
+              << "\n";
+  }
+}
+
+// Multiscale plans against the exact step for large circular filters, on
+// the field left by a few exact generations from a central seed.
+void multiscale(size_t width, size_t height, double target) {
+  for (size_t radius : {50, 100, 200}) {
+    const size_t size = 2 * radius + 1;
+    PixelBackEnd<float, RowMajor> scene(width, height, size);
+    scene.setFilter(filters::circular(size, 1.0f));
+    scene.seed(1.0f);
+    scene.jump(3, std::cout);
+    std::cout << "radius " << radius << "\n";
+    scene.planMultiscale(target, std::cout);
+  }
+}
+
+// Shells plans against direct steps for the circular and ring filters.
+void shells(size_t width, size_t height, double target) {
+  std::cout << "filter    radius  boxes  error   direct ms  shells ms\n";
+  for (const bool ring : {false, true}) {
+    for (size_t radius : {8, 16, 32}) {
+      const size_t size = 2 * radius + 1;
+      PixelBackEnd<float, RowMajor> scene(width, height, size);
+      scene.setFilter(ring ? filters::ring(size, 1.0f)
+                           : filters::circular(size, 1.0f));
+      scene.seed(1.0f);
+      const double direct = milliseconds([&] { scene.step(); }, 3);
+      std::ostringstream log;
+      scene.planShells(target, log);
+      if (scene.plan().method != ConvPlan::Method::Shells) {
+        std::cout << (ring ? "ring    " : "circular") << std::setw(8)
+                  << radius << "  no plan within " << target << "\n";
+        continue;
+      }
+      const auto fit = filters::fitShells(
+          ring ? filters::ring(size, 1.0f) : filters::circular(size, 1.0f),
+          scene.plan().shells, scene.plan().steps);
+      const double fitted = milliseconds([&] { scene.step(); }, 3);
+      std::cout << (ring ? "ring    " : "circular") << std::setw(8) << radius
+                << std::setw(7) << fit.boxes.size() << std::setw(8)
+                << std::setprecision(3) << fit.error << std::setw(12)
+                << direct << std::setw(11) << fitted << "\n";
+    }
+  }
+  // A filter wider than the halo, set under a Shells plan, has to step as
+  // it does under a Direct one.
+  PixelBackEnd<float, RowMajor> fitted(width, height, 3);
+  PixelBackEnd<float, RowMajor> exact(width, height, 3);
+  ConvPlan plan;
+  plan.method = ConvPlan::Method::Shells;
+  plan.shells = 4;
+  plan.steps = 2;
+  fitted.setPlan(plan);
+  for (auto *scene : {&fitted, &exact}) {
+    scene->setFilter(filters::circular(33, 1.0f));
+    scene->seed(1.0f);
+    scene->step();
+  }
+  double difference = 0.0;
+  for (size_t y = 0; y < height; ++y) {
     for (size_t x = 0; x < width; ++x) {
-      for (size_t y = 0; y < width; ++y) {
-        v.emplace_back(x, y);
+      difference = std::max(
+          difference, std::fabs(double(fitted.get(x, y)) - exact.get(x, y)));
+    }
+  }
+  std::cout << "filter wider than the halo: difference from direct "
+            << difference << "\n";
+}
+
+// Sparse plans against direct steps for the ring filter and for kernels
+// that are mostly zeros: a thin annulus, a cross and a 3 x 3 stencil
+// dilated by radius / 2.
+void sparse(size_t width, size_t height, double target) {
+  std::cout << "filter    radius   taps  runs  error   direct ms  sparse ms\n";
+  for (const std::string name : {"ring", "annulus", "cross", "dilated"}) {
+    for (size_t radius : {8, 16, 32}) {
+      const long size = 2 * radius + 1;
+      const long r = radius;
+      Image<float> filter = filters::ring(size, 1.0f);
+      if (name != "ring") {
+        filter.setZero();
+        for (long dy = -r; dy <= r; ++dy) {
+          for (long dx = -r; dx <= r; ++dx) {
+            const double d = std::hypot(double(dx), double(dy));
+            const long step = std::max<long>(1, r / 2);
+            const bool on =
+                name == "annulus" ? std::fabs(d - (r - 1)) < 1.0
+                : name == "cross" ? dx == 0 || dy == 0
+                                  : dx % step == 0 && dy % step == 0 &&
+                                        std::abs(dx) <= step &&
+                                        std::abs(dy) <= step;
+            if (on)
+              filter.set(dx + r, dy + r, 1.0f);
+          }
+        }
+        filter = filters::normalize(filter);
+      }
+      PixelBackEnd<float, RowMajor> scene(width, height, size);
+      scene.setFilter(filter);
+      scene.seed(1.0f);
+      const double direct = milliseconds([&] { scene.step(); }, 3);
+      std::ostringstream log;
+      scene.planSparse(target, log);
+      if (scene.plan().method != ConvPlan::Method::Sparse) {
+        std::cout << std::left << std::setw(8) << name << std::right
+                  << std::setw(8) << radius << "  no faster plan within "
+                  << target << ", direct " << direct << " ms\n";
+        continue;
+      }
+      const auto taps =
+          Image<float>::sparsify(filter, scene.plan().threshold);
+      const double fitted = milliseconds([&] { scene.step(); }, 3);
+      std::cout << std::left << std::setw(8) << name << std::right
+                << std::setw(8) << radius << std::setw(7)
+                << taps.weights.size() << std::setw(6) << taps.runs.size()
+                << std::setw(8) << std::setprecision(3) << taps.error
+                << std::setw(12) << direct << std::setw(11) << fitted
+                << "\n";
+    }
+  }
+}
+
+// Winograd tiles against direct steps for 3 x 3 and 5 x 5 filters, with the
+// largest difference of a step relative to the largest cell.
+void winograd(size_t width, size_t height) {
+  std::cout << "size  tile  direct ms  winograd ms  speedup  error\n";
+  for (const size_t size : {3, 5}) {
+    PixelBackEnd<float, RowMajor> scene(width, height, size);
+    scene.setFilter(filters::ring(size, 1.0f));
+    scene.seed(1.0f);
+    for (size_t i = 0; i < 4; ++i) {
+      scene.step();
+    }
+    auto exact = scene;
+    exact.step();
+    const double direct = milliseconds([&] { scene.step(); }, 3);
+    for (const size_t tile : {2, 4, 6}) {
+      if (tile + size > 9)
+        continue;
+      ConvPlan plan;
+      plan.method = ConvPlan::Method::Winograd;
+      plan.tile = tile;
+      auto fast = std::make_unique<PixelBackEnd<float, RowMajor>>(exact);
+      fast->setPlan(plan);
+      const double ms = milliseconds([&] { fast->step(); }, 3);
+      auto check = std::make_unique<PixelBackEnd<float, RowMajor>>(exact);
+      auto reference = std::make_unique<PixelBackEnd<float, RowMajor>>(exact);
+      check->setPlan(plan);
+      check->step();
+      reference->step();
+      double error = 0.0;
+      double peak = 0.0;
+      for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+          error = std::max<double>(
+              error, std::fabs(check->get(x, y) - reference->get(x, y)));
+          peak = std::max<double>(peak, std::fabs(reference->get(x, y)));
+        }
+      }
+      std::cout << std::setw(4) << size << std::setw(6) << tile
+                << std::setw(11) << direct << std::setw(13) << ms
+                << std::setw(9) << std::setprecision(3) << direct / ms
+                << std::setw(11) << (peak > 0.0 ? error / peak : 0.0)
+                << "\n";
+    }
+  }
+}
+
+// One pass over several filters against a conv2d call per filter, for
+// rings of the same size. The field is random in [0, 1).
+void kernels(size_t width, size_t height) {
+  std::cout << "size  filters  separate ms  fused ms  speedup\n";
+  for (const size_t size : {5, 9, 17}) {
+    Image<float> field(width, height, size / 2);
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> uniform;
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        field.set(x, y, uniform(random));
+      }
+    }
+    field.fillHalo(Boundary::Periodic);
+    for (const size_t count : {1, 2, 4, 8}) {
+      std::vector<Image<float>> rings;
+      for (size_t i = 0; i < count; ++i) {
+        rings.push_back(filters::ring(size, 1.0f) * float(i + 1));
+      }
+      const double separate = milliseconds([&] {
+        for (const auto &filter : rings) {
+          Image<float>::conv2d(field, filter);
+        }
+      }, 3);
+      const double fused =
+          milliseconds([&] { Image<float>::conv2d(field, rings); }, 3);
+      std::cout << std::setprecision(3) << std::setw(4) << size
+                << std::setw(9) << count << std::setw(13) << separate
+                << std::setw(10) << fused << std::setw(9) << separate / fused
+                << "\n";
+    }
+  }
+}
+
+// Hardware counters of the phases of a step for growing kernel radii:
+// filling the halo, the convolution alone, and a whole step with its
+// pyramid and statistics. Bytes per cell counts a 64 byte line per last
+// level cache miss, an estimate of the memory traffic. Events this machine
+// can't count show as n/a.
+void phases(size_t width, size_t height) {
+  const int runs = 5;
+  const double cells = double(width) * height * runs;
+  std::cout << "radius  phase       ms   cpu ms    IPC  bytes/cell"
+            << "  dTLB/kcell  vector/cell\n";
+  const auto measure = [&](size_t radius, const char *phase, auto &&f) {
+    // The warm up starts the thread pool, whose threads are then counted.
+    f();
+    const counters::Process process;
+    const counters::Sample before = process.read();
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i) {
+      f();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const counters::Sample sample = process.read() - before;
+    const auto column = [&](int width, bool counted, double value) {
+      if (counted)
+        std::cout << std::setw(width) << value;
+      else
+        std::cout << std::setw(width) << "n/a";
+    };
+    const auto &value = sample.values;
+    const auto &counted = sample.counted;
+    std::cout << std::fixed << std::setprecision(2) << std::setw(6) << radius
+              << "  " << std::left << std::setw(6) << phase << std::right;
+    column(9, true,
+           std::chrono::duration<double, std::milli>(end - start).count() /
+               runs);
+    column(9, counted[counters::TaskClock],
+           value[counters::TaskClock] * 1e-6 / runs);
+    column(7, counted[counters::Cycles] && counted[counters::Instructions],
+           value[counters::Instructions] / value[counters::Cycles]);
+    column(12, counted[counters::LlcMisses],
+           value[counters::LlcMisses] * 64 / cells);
+    column(12, counted[counters::DtlbMisses],
+           value[counters::DtlbMisses] * 1000 / cells);
+    column(13, counted[counters::VectorOps],
+           value[counters::VectorOps] / cells);
+    std::cout << "\n" << std::defaultfloat;
+  };
+  for (const size_t radius : {2, 8, 32}) {
+    const size_t size = 2 * radius + 1;
+    PixelBackEnd<float> scene(width, height, size);
+    scene.setFilter(filters::circular(size, 1.0f));
+    scene.seed(1.0f);
+    Image<float> field(width, height, radius);
+    field.fillHalo(Boundary::Periodic);
+    const auto filter = filters::circular(size, 1.0f);
+    measure(radius, "halo", [&] { field.fillHalo(Boundary::Periodic); });
+    measure(radius, "conv2d", [&] { Image<float>::conv2d(field, filter); });
+    measure(radius, "step", [&] { scene.step(); });
+  }
+}
+
+// A circular filter plus a weighted ring twice its size, then the same
+// with a growth function on the ring, stepped as a rule against a conv2d
+// pass per term combined with Image arithmetic, which also fills the halo
+// and feeds a pyramid and stats as a step does. Rules with growth are also
+// stepped with separate passes and with the fused pass.
+void rules(size_t width, size_t height) {
+  using Scene = PixelBackEnd<float, RowMajor>;
+  const auto growth = [](float u) {
+    return 2.0f * std::exp(-(u - 0.15f) * (u - 0.15f) / 0.005f) - 1.0f;
+  };
+  std::cout << "sizes    growth  terms ms  rule ms  speedup  separate ms"
+            << "  speedup  fused ms  speedup\n";
+  for (const size_t size : {5, 9, 17}) {
+    const auto disc = filters::circular(size, 1.0f);
+    const auto ring = filters::ring(2 * size + 1, 1.0f);
+    for (const bool grows : {false, true}) {
+      Scene scene(width, height, 2 * size + 1);
+      std::vector<Scene::Term> terms{{disc}, {ring, 0.3f}};
+      if (grows)
+        terms[1].growth = growth;
+      scene.setFilter(terms);
+      scene.seed(1.0f);
+      scene.step();
+      Image<float> field(width, height, size);
+      for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+          field.set(x, y, scene.get(x, y));
+        }
+      }
+      Pyramid pyramid(width, height);
+      FieldStats stats;
+      const double perTerm = milliseconds([&] {
+        field.fillHalo(Boundary::Periodic);
+        const auto inner = Image<float>::conv2d(field, disc);
+        auto outer = Image<float>::conv2d(field, ring);
+        if (grows) {
+          for (size_t y = 0; y < height; ++y) {
+            for (size_t x = 0; x < width; ++x) {
+              outer.set(x, y, growth(outer.get(x, y)));
+            }
+          }
+        }
+        field = inner + outer * 0.3f;
+        pyramid.rebuild(field);
+        stats = FieldStats();
+        for (size_t y = 0; y < height; ++y) {
+          for (size_t x = 0; x < width; ++x) {
+            stats.add(field.get(x, y));
+          }
+        }
+      }, 3);
+      const double rule = milliseconds([&] { scene.step(); }, 3);
+      std::cout << std::setprecision(3) << std::setw(3) << size << "+"
+                << std::left << std::setw(6) << 2 * size + 1 << std::right
+                << std::setw(5) << (grows ? "yes" : "no") << std::setw(10)
+                << perTerm << std::setw(9) << rule << std::setw(9)
+                << perTerm / rule;
+      if (grows) {
+        for (const auto kind :
+             {ConvPlan::Rule::Separate, ConvPlan::Rule::Fused}) {
+          ConvPlan plan;
+          plan.rule = kind;
+          scene.setPlan(plan);
+          const double ms = milliseconds([&] { scene.step(); }, 3);
+          std::cout << std::setw(kind == ConvPlan::Rule::Fused ? 10 : 13)
+                    << ms << std::setw(9) << perTerm / ms;
+        }
       }
+      std::cout << "\n";
+    }
+  }
+}
+// One-sided p-value of the Mann-Whitney U test that samples of current
+// tend to be larger than those of baseline, from the normal approximation
+// with tie and continuity corrections.
+double mannWhitney(const std::vector<double> &baseline,
+                   const std::vector<double> &current) {
+  const double n1 = baseline.size();
+  const double n2 = current.size();
+  const double n = n1 + n2;
+  if (n1 == 0 || n2 == 0)
+    return 1.0;
+  std::vector<std::pair<double, bool>> pooled;
+  for (const double value : baseline) {
+    pooled.push_back({value, false});
+  }
+  for (const double value : current) {
+    pooled.push_back({value, true});
+  }
+  std::sort(pooled.begin(), pooled.end());
+  // Rank sum of current, ties sharing their average rank.
+  double rankSum = 0.0;
+  double ties = 0.0;
+  for (size_t i = 0; i < pooled.size();) {
+    size_t j = i;
+    while (j < pooled.size() && pooled[j].first == pooled[i].first) {
+      ++j;
+    }
+    const double rank = (i + j + 1) / 2.0;
+    for (size_t k = i; k < j; ++k) {
+      rankSum += pooled[k].second ? rank : 0.0;
+    }
+    const double t = j - i;
+    ties += t * t * t - t;
+    i = j;
+  }
+  const double u = rankSum - n2 * (n2 + 1) / 2;
+  const double sigma =
+      std::sqrt(n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1))));
+  if (sigma == 0.0)
+    return 1.0;
+  const double z = (u - n1 * n2 / 2 - 0.5) / sigma;
+  return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+// Median of samples, which must not be empty.
+double median(std::vector<double> samples) {
+  std::nth_element(samples.begin(), samples.begin() + samples.size() / 2,
+                   samples.end());
+  return samples[samples.size() / 2];
+}
+
+using Samples = std::map<std::string, std::vector<double>>;
+
+// Times of a fixed set of workloads, in milliseconds per call or frame:
+// conv2d for small and large kernels in both layouts, a whole step, and
+// frames of the visualizer drawing inside the step and zoomed out
+// through render. Sizes don't depend on the command line, so that results
+// stay comparable. The calls are timed in turns, one of each workload per
+// round, so that a slow spell of the host spreads over all of them.
+Samples workloads() {
+  const size_t size = 512;
+  const int runs = 15;
+  Samples samples;
+  std::vector<std::pair<std::string, std::function<void()>>> calls;
+  std::vector<Image<float>> fields;
+  std::vector<Image<float, Tiled>> tiledFields;
+  std::vector<Image<float>> kernels;
+  fields.reserve(2);
+  tiledFields.reserve(2);
+  kernels.reserve(2);
+  for (const size_t radius : {2, 8}) {
+    const auto &filter = kernels.emplace_back(
+        filters::circular(2 * radius + 1, 1.0f));
+    auto &field = fields.emplace_back(size, size, radius);
+    auto &tiled = tiledFields.emplace_back(size, size, radius);
+    field.fillHalo(Boundary::Periodic);
+    tiled.fillHalo(Boundary::Periodic);
+    const std::string r = "r" + std::to_string(radius);
+    calls.emplace_back("conv2d " + r,
+                       [&] { Image<float>::conv2d(field, filter); });
+    calls.emplace_back("conv2d " + r + " tiled",
+                       [&] { Image<float, Tiled>::conv2d(tiled, filter); });
+  }
+  PixelBackEnd<float> scene(size, size, 17);
+  scene.setFilter(filters::circular(17, 1.0f));
+  scene.seed(1.0f);
+  calls.emplace_back("step r8", [&] { scene.step(); });
+  for (int i = -1; i < runs; ++i) {
+    for (const auto &[name, f] : calls) {
+      const auto start = std::chrono::steady_clock::now();
+      f();
+      const auto end = std::chrono::steady_clock::now();
+      // Round -1 warms up.
+      if (i >= 0)
+        samples[name].push_back(
+            std::chrono::duration<double, std::milli>(end - start).count());
+    }
+  }
+  // At one cell per pixel the step draws the frame, zoomed out render
+  // reduces the pyramid.
+  for (const auto &[name, screen] :
+       {std::make_pair("frame fused", size), {"frame zoomed", size / 4}}) {
+    ConvolutionVisualizer<> demo(size, size, 5, 0.9998);
+    samples[name] =
+        headless::run(demo, int(screen), int(screen), 1, 2 * runs).frames;
+  }
+  return samples;
+}
+
+// Writes samples as the baseline read by readBaseline.
+void writeBaseline(std::ostream &out, const Samples &samples) {
+  out << "{\n  \"cpu\": \"" << tuning::cpuModel() << "\",\n"
+      << "  \"workloads\": {";
+  const char *separator = "\n";
+  for (const auto &[name, times] : samples) {
+    out << separator << "    \"" << name << "\": [";
+    for (size_t i = 0; i < times.size(); ++i) {
+      out << (i ? ", " : "") << times[i];
+    }
+    out << "]";
+    separator = ",\n";
+  }
+  out << "\n  }\n}\n";
+}
+
+// Whether every workload has samples. Names those without on err.
+bool complete(const Samples &samples, std::ostream &err) {
+  bool all = true;
+  for (const auto &[name, times] : samples) {
+    if (times.empty()) {
+      err << "Workload " << name << " produced no samples\n";
+      all = false;
+    }
+  }
+  return all;
+}
+
+// Reads the workloads of a baseline written by writeBaseline: the arrays
+// of numbers under their quoted names. Other values are skipped. The CPU
+// the baseline was recorded on goes to cpu, empty when it is missing.
+Samples readBaseline(std::istream &in, std::string &cpu) {
+  const std::string text{std::istreambuf_iterator<char>(in),
+                         std::istreambuf_iterator<char>()};
+  Samples samples;
+  cpu.clear();
+  const std::string cpuKey = "\"cpu\"";
+  const size_t cpuAt = text.find(cpuKey);
+  if (cpuAt != std::string::npos) {
+    const size_t open = text.find('"', cpuAt + cpuKey.size());
+    const size_t close =
+        open == std::string::npos ? open : text.find('"', open + 1);
+    if (close != std::string::npos)
+      cpu = text.substr(open + 1, close - open - 1);
+  }
+  const std::string key = "\"workloads\"";
+  size_t at = text.find(key);
+  if (at == std::string::npos)
+    return samples;
+  at += key.size();
+  while ((at = text.find('"', at)) != std::string::npos) {
+    const size_t close = text.find('"', at + 1);
+    if (close == std::string::npos)
+      break;
+    const std::string name = text.substr(at + 1, close - at - 1);
+    const size_t list = text.find_first_not_of(" \t\n:", close + 1);
+    at = close + 1;
+    if (list == std::string::npos || text[list] != '[')
+      continue;
+    const size_t end = text.find(']', list);
+    std::istringstream numbers(text.substr(list + 1, end - list - 1));
+    auto &times = samples[name];
+    double value;
+    char comma;
+    while (numbers >> value) {
+      times.push_back(value);
+      numbers >> comma;
+    }
+    at = end;
+  }
+  return samples;
+}
+
+// Runs the workloads and compares them with the baseline at path. A
+// workload regresses when its median is more than slowdown (a fraction)
+// above the baseline's and the Mann-Whitney test finds it slower at the 1%
+// level. Returns the number of regressions plus the baseline workloads
+// this run lacks, or -1 without a baseline, with one recorded on another
+// CPU, or when a workload produced no samples.
+int compare(const std::string &path, double slowdown) {
+  std::ifstream in(path);
+  std::string cpu;
+  const Samples baseline = readBaseline(in, cpu);
+  if (baseline.empty()) {
+    std::cerr << "No baseline in " << path
+              << ", write one with --bench-baseline\n";
+    return -1;
+  }
+  if (cpu != tuning::cpuModel()) {
+    std::cerr << "The baseline in " << path << " was recorded on "
+              << (cpu.empty() ? "an unknown CPU" : cpu) << ", not on this "
+              << tuning::cpuModel() << "; write one here with "
+              << "--bench-baseline\n";
+    return -1;
+  }
+  const Samples current = workloads();
+  if (!complete(current, std::cerr))
+    return -1;
+  int regressions = 0;
+  std::cout << "workload          baseline ms  current ms   change        p\n";
+  for (const auto &[name, times] : current) {
+    const auto found = baseline.find(name);
+    std::cout << std::left << std::setw(18) << name << std::right;
+    if (found == baseline.end() || found->second.empty()) {
+      std::cout << "  not in baseline\n";
+      continue;
     }
-    return v;
+    const double before = median(found->second);
+    const double after = median(times);
+    const double change = after / before - 1;
+    const double p = mannWhitney(found->second, times);
+    const bool regressed = change > slowdown && p < 0.01;
+    regressions += regressed;
+    std::cout << std::fixed << std::setprecision(3) << std::setw(11) << before
+              << std::setw(12) << after << std::showpos << std::setw(8)
+              << std::setprecision(1) << change * 100 << "%" << std::noshowpos
+              << std::setw(9) << std::setprecision(4) << p
+              << (regressed ? "  SLOWER" : "") << "\n"
+              << std::defaultfloat;
   }
+  int missing = 0;
+  for (const auto &[name, times] : baseline) {
+    if (current.count(name) == 0) {
+      std::cout << std::left << std::setw(18) << name << std::right
+                << "  missing from this run\n";
+      ++missing;
+    }
+  }
+  std::cout << regressions << " of " << current.size()
+            << " workloads slower than the baseline by more than "
+            << slowdown * 100 << "%";
+  if (missing > 0)
+    std::cout << ", " << missing << " baseline workloads missing";
+  std::cout << "\n";
+  return regressions + missing;
+}
+} // namespace bench
+
+// How the visualizer runs, besides the grid and screen sizes.
+struct Session {
+  // Autotune first, with results cached in this file.
+  std::string tuneCache;
+  // Read parameters from this file, see ConvolutionVisualizer::loadParameters.
+  std::string parametersPath;
+  // Log input to one file, or take it from another.
+  std::string recordPath;
+  std::string replayPath;
+  // Run this many frames without a window.
+  size_t headlessFrames = 0;
 };
 
-int main() {
-  size_t size = 512;
-  ConvolutionVisualizer demo(size, 5, 0.9998);
-  if (demo.Construct(size, size, 4, 4))
+// Runs the visualizer on a field of T cells stored in the given layout.
+template <typename T, typename Layout>
+void visualize(std::pair<size_t, size_t> grid, std::pair<size_t, size_t> screen,
+               int pixelSize, const Session &session) {
+  ConvolutionVisualizer<T, Layout> demo(grid.first, grid.second, 5, 0.9998);
+  demo.reportMemory(std::cout);
+  if (!session.tuneCache.empty())
+    demo.autotune(session.tuneCache);
+  if (!session.parametersPath.empty())
+    demo.loadParameters(session.parametersPath);
+  if (!session.recordPath.empty())
+    demo.recordInput(session.recordPath);
+  if (!session.replayPath.empty() && !demo.replayInput(session.replayPath))
+    return;
+  if (session.headlessFrames > 0)
+    headless::report(headless::run(demo, screen.first, screen.second,
+                                   pixelSize, session.headlessFrames),
+                     screen.first, screen.second, std::cout);
+  else if (demo.Construct(screen.first, screen.second, pixelSize, pixelSize))
     demo.Start();
+}
+
+template <typename T>
+void visualize(bool tiled, std::pair<size_t, size_t> grid,
+               std::pair<size_t, size_t> screen, int pixelSize,
+               const Session &session) {
+  if (tiled)
+    visualize<T, Tiled>(grid, screen, pixelSize, session);
+  else
+    visualize<T, RowMajor>(grid, screen, pixelSize, session);
+}
+
+// Usage: testProg [options] [gridSize] [screenSize] [pixelSize]
+// Sizes are either a single number or WIDTHxHEIGHT. Options:
+//   --tiled         store the field in the Tiled layout
+//   --type=T        cell type: float (default), double, half or int16
+//   --autotune[=F]  pick the fastest convolution plan, cached in file F
+//                   (default convtune.cache)
+//   --params=F      read gain, mouseAdd, mouseMult and filterSize from F,
+//                   again whenever L is pressed
+//   --headless=N    run the visualizer for N frames without a window and
+//                   print frame timings
+//   --record=F      log mouse and keyboard input with its generations to F
+//   --replay=F      take input from the log F instead of the mouse and
+//                   keyboard, at the generations it was recorded at
+//   --trace=F       write a Chrome trace of steps, strips, frames, render,
+//                   input and file access to F on exit
+//   --bench-layout  time both layouts for kernel radii 2 to 32 and exit
+//   --bench-multiscale[=E]  time and check multiscale steps for kernel radii
+//                   50 to 200 with error target E (default 0.01) and exit
+//   --bench-shells[=E]  time shell approximations within filter error E
+//                   (default 0.1) against direct steps for radii 8 to 32
+//   --bench-sparse[=E]  time sparse tap lists within filter error E
+//                   (default 0.01) against direct steps for radii 8 to 32
+//   --bench-winograd  time and check Winograd tiles against direct steps
+//                   for 3 x 3 and 5 x 5 filters and exit
+//   --bench-kernels  time 1 to 8 filters applied in one pass against a pass
+//                   per filter and exit
+//   --bench-rules   time rules of two terms, with and without growth,
+//                   against a pass per term and exit
+//   --bench-counters  count cycles, instructions, cache and TLB misses and
+//                   vector instructions of the phases of a step and exit
+//   --bench-baseline[=F]  time a fixed set of conv2d, step and frame
+//                   workloads, write them to F (default
+//                   bench-baseline.json) and exit
+//   --bench-compare[=F]  time the same workloads, compare them with the
+//                   baseline F and exit with status 1 if any is slower
+//   --slowdown=X    median slowdown, as a fraction, that --bench-compare
+//                   tolerates (default 0.1)
+int main(int argc, char **argv) {
+  std::vector<std::string> args;
+  std::set<std::string> options;
+  std::string type = "float";
+  Session session;
+  std::string tracePath;
+  double multiscaleTarget = 0.0;
+  double shellsTarget = 0.0;
+  double sparseTarget = 0.0;
+  std::string baselinePath;
+  std::string comparePath;
+  double slowdown = 0.1;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg.rfind("--type=", 0) == 0)
+      type = arg.substr(7);
+    else if (arg == "--autotune")
+      session.tuneCache = "convtune.cache";
+    else if (arg.rfind("--autotune=", 0) == 0)
+      session.tuneCache = arg.substr(11);
+    else if (arg.rfind("--params=", 0) == 0)
+      session.parametersPath = arg.substr(9);
+    else if (arg.rfind("--headless=", 0) == 0)
+      session.headlessFrames = std::stoul(arg.substr(11));
+    else if (arg.rfind("--record=", 0) == 0)
+      session.recordPath = arg.substr(9);
+    else if (arg.rfind("--replay=", 0) == 0)
+      session.replayPath = arg.substr(9);
+    else if (arg.rfind("--trace=", 0) == 0)
+      tracePath = arg.substr(8);
+    else if (arg == "--bench-multiscale")
+      multiscaleTarget = 0.01;
+    else if (arg.rfind("--bench-multiscale=", 0) == 0)
+      multiscaleTarget = std::stod(arg.substr(19));
+    else if (arg == "--bench-shells")
+      shellsTarget = 0.1;
+    else if (arg.rfind("--bench-shells=", 0) == 0)
+      shellsTarget = std::stod(arg.substr(15));
+    else if (arg == "--bench-sparse")
+      sparseTarget = 0.01;
+    else if (arg.rfind("--bench-sparse=", 0) == 0)
+      sparseTarget = std::stod(arg.substr(15));
+    else if (arg == "--bench-baseline")
+      baselinePath = "bench-baseline.json";
+    else if (arg.rfind("--bench-baseline=", 0) == 0)
+      baselinePath = arg.substr(17);
+    else if (arg == "--bench-compare")
+      comparePath = "bench-baseline.json";
+    else if (arg.rfind("--bench-compare=", 0) == 0)
+      comparePath = arg.substr(16);
+    else if (arg.rfind("--slowdown=", 0) == 0)
+      slowdown = std::stod(arg.substr(11));
+    else if (arg.rfind("--", 0) == 0)
+      options.insert(arg);
+    else
+      args.push_back(arg);
+  }
+  const auto parseSize = [](const std::string &arg) {
+    const auto split = arg.find('x');
+    const size_t width = std::stoul(arg.substr(0, split));
+    const size_t height =
+        split == std::string::npos ? width : std::stoul(arg.substr(split + 1));
+    return std::make_pair(width, height);
+  };
+  const auto grid = parseSize(args.size() > 0 ? args[0] : "512");
+  const trace::Capture capture(tracePath);
+  if (options.count("--bench-layout")) {
+    bench::layouts(grid.first, grid.second);
+    return 0;
+  }
+  if (options.count("--bench-winograd")) {
+    bench::winograd(grid.first, grid.second);
+    return 0;
+  }
+  if (options.count("--bench-kernels")) {
+    bench::kernels(grid.first, grid.second);
+    return 0;
+  }
+  if (options.count("--bench-rules")) {
+    bench::rules(grid.first, grid.second);
+    return 0;
+  }
+  if (options.count("--bench-counters")) {
+    bench::phases(grid.first, grid.second);
+    return 0;
+  }
+  if (!baselinePath.empty()) {
+    const auto samples = bench::workloads();
+    if (!bench::complete(samples, std::cerr))
+      return 1;
+    std::ofstream out(baselinePath);
+    bench::writeBaseline(out, samples);
+    std::cout << "Wrote baseline to " << baselinePath << "\n";
+    return 0;
+  }
+  if (!comparePath.empty())
+    return bench::compare(comparePath, slowdown) == 0 ? 0 : 1;
+  if (multiscaleTarget > 0.0) {
+    bench::multiscale(grid.first, grid.second, multiscaleTarget);
+    return 0;
+  }
+  if (shellsTarget > 0.0) {
+    bench::shells(grid.first, grid.second, shellsTarget);
+    return 0;
+  }
+  if (sparseTarget > 0.0) {
+    bench::sparse(grid.first, grid.second, sparseTarget);
+    return 0;
+  }
+  const auto screen =
+      args.size() > 1 ? parseSize(args[1])
+                      : std::make_pair(std::min<size_t>(grid.first, 512),
+                                       std::min<size_t>(grid.second, 512));
+  const int pixelSize = args.size() > 2 ? std::stoi(args[2]) : 4;
+  const bool tiled = options.count("--tiled");
+  if (type == "float")
+    visualize<float>(tiled, grid, screen, pixelSize, session);
+  else if (type == "double")
+    visualize<double>(tiled, grid, screen, pixelSize, session);
+  else if (type == "int16")
+    visualize<int16_t>(tiled, grid, screen, pixelSize, session);
+#if defined(__FLT16_MAX__)
+  else if (type == "half")
+    visualize<_Float16>(tiled, grid, screen, pixelSize, session);
+#endif
+  else {
+    std::cerr << "Unknown cell type " << type << "\n";
+    return 1;
+  }
   return 0;
 }